@@ -10,6 +10,140 @@
 
 OSDefineMetaClassAndStructors(EmeraldSDHC, super);
 
+//
+// Known host controller quirks.
+// Entries follow the Linux sdhci-pci-core.c and sdhci-acpi.c drivers for the same parts.
+//
+static const SDHCQuirks SDHCQuirksTable[] = {
+  //
+  // Ricoh R5CE822/R5CE823 do not report usable capabilities.
+  // These only work with SDMA and a 33 MHz base clock, as set by Linux ricoh_mmc_probe_slot().
+  //
+  {
+    "Ricoh R5CE822", 0x1180, 0xE822, nullptr,
+    kSDHCRegCapabilitiesVoltage3_3Supported | kSDHCRegCapabilitiesHighSpeedSupported | kSDHCRegCapabilitiesSDMASupported,
+    UINT64_MAX, 33, kSDATimingModeHighSpeed, 0
+  },
+  {
+    "Ricoh R5CE823", 0x1180, 0xE823, nullptr,
+    kSDHCRegCapabilitiesVoltage3_3Supported | kSDHCRegCapabilitiesHighSpeedSupported | kSDHCRegCapabilitiesSDMASupported,
+    UINT64_MAX, 33, kSDATimingModeHighSpeed, 0
+  },
+  //
+  // Intel Bay Trail eMMC does not report 8-bit support and cannot run HS400.
+  // Linux byt_emmc_probe_slot() adds 8-bit support, and only enables HS400 for the newer parts below.
+  //
+  {
+    "Intel Bay Trail eMMC", 0x8086, 0x0F14, "80860F14",
+    kSDHCRegCapabilitiesEmbedded8BitSupported, 0, 0, kSDATimingModeHS200, 0
+  },
+  //
+  // Newer Intel eMMC controllers support HS400 enhanced strobe.
+  // Linux byt_emmc_probe_slot() enables HS400 on these, with enhanced strobe set in the vendor register by intel_hs400_enhanced_strobe().
+  //
+  {
+    "Intel Gemini Lake eMMC", 0x8086, 0x31CC, nullptr,
+    0, 0, 0, kSDATimingModeHS400, kSDHCQuirkFlagIntelEnhancedStrobe
+  },
+  {
+    "Intel Cannon Lake PCH eMMC", 0x8086, 0x9DC4, nullptr,
+    0, 0, 0, kSDATimingModeHS400, kSDHCQuirkFlagIntelEnhancedStrobe
+  },
+  {
+    "Intel Ice Lake PCH eMMC", 0x8086, 0x34C4, nullptr,
+    0, 0, 0, kSDATimingModeHS400, kSDHCQuirkFlagIntelEnhancedStrobe
+  },
+  //
+  // AMD eMMC requires vendor-specific DLL programming for HS400, done by Linux sdhci_acpi_amd_hs400_dll() but not by this driver.
+  // Capped at HS200 until that is supported.
+  //
+  {
+    "AMD eMMC", 0, 0, "AMDI0040",
+    0, 0, 0, kSDATimingModeHS200, 0
+  }
+};
+
+#if EMERALDSDHC_REGISTER_TRACE
+EmeraldSDHCRegisterTraceEntry EmeraldSDHCRegisterAccessTrace::_entries[kEmeraldSDHCRegisterTraceSize] = { };
+volatile SInt32               EmeraldSDHCRegisterAccessTrace::_nextEntry       = 0;
+volatile SInt64               EmeraldSDHCRegisterAccessTrace::_readCount       = 0;
+volatile SInt64               EmeraldSDHCRegisterAccessTrace::_writeCount      = 0;
+volatile SInt64               EmeraldSDHCRegisterAccessTrace::_commandCount    = 0;
+volatile SInt64               EmeraldSDHCRegisterAccessTrace::_shadowReadCount = 0;
+
+OSData* EmeraldSDHCRegisterAccessTrace::copyTrace() {
+  OSData                        *traceData;
+  EmeraldSDHCRegisterTraceEntry *entry;
+  EmeraldSDHCRegisterTraceEntry entryCopy;
+  UInt32                        sequence;
+  UInt32                        nextEntry  = (UInt32) _nextEntry;
+  UInt32                        entryCount = nextEntry < kEmeraldSDHCRegisterTraceSize ? nextEntry : kEmeraldSDHCRegisterTraceSize;
+
+  //
+  // Copy entries from oldest to newest.
+  // An entry is only copied if its sequence is the expected one both before and after copying it,
+  //   entries still being written or overwritten by newer accesses during the copy are left out.
+  //
+  traceData = OSData::withCapacity(entryCount * sizeof (_entries[0]));
+  if (traceData == nullptr) {
+    return nullptr;
+  }
+  for (UInt32 i = nextEntry - entryCount; i != nextEntry; i++) {
+    entry    = &_entries[i & (kEmeraldSDHCRegisterTraceSize - 1)];
+    sequence = *(volatile UInt32 *) &entry->sequence;
+    OSMemoryBarrier();
+    entryCopy = *entry;
+    OSMemoryBarrier();
+    if (sequence == i + 1 && *(volatile UInt32 *) &entry->sequence == sequence) {
+      traceData->appendBytes(&entryCopy, sizeof (entryCopy));
+    }
+  }
+  return traceData;
+}
+
+void EmeraldSDHCRegisterAccessTrace::getCounts(UInt64 *readCount, UInt64 *writeCount, UInt64 *commandCount, UInt64 *shadowReadCount) {
+  *readCount       = (UInt64) _readCount;
+  *writeCount      = (UInt64) _writeCount;
+  *commandCount    = (UInt64) _commandCount;
+  *shadowReadCount = (UInt64) _shadowReadCount;
+}
+
+IOReturn EmeraldSDHC::setProperties(OSObject *properties) {
+  OSDictionary *propertiesDict = OSDynamicCast(OSDictionary, properties);
+  OSData       *traceData;
+  UInt64       readCount;
+  UInt64       writeCount;
+  UInt64       commandCount;
+  UInt64       shadowReadCount;
+
+  //
+  // Publish a snapshot of the register trace and access counts on request, other properties are left to the superclass.
+  //
+  if (propertiesDict == nullptr || propertiesDict->getObject(kEmeraldSDHCRegisterTraceRequestKey) == nullptr) {
+    return super::setProperties(properties);
+  }
+
+  traceData = EmeraldSDHCRegisterAccessTrace::copyTrace();
+  if (traceData == nullptr) {
+    return kIOReturnNoMemory;
+  }
+  setProperty(kEmeraldSDHCRegisterTraceKey, traceData);
+  traceData->release();
+
+  //
+  // Counts are totals since load, counts taken before and after a workload give its reads per command.
+  //
+  EmeraldSDHCRegisterAccessTrace::getCounts(&readCount, &writeCount, &commandCount, &shadowReadCount);
+  setProperty(kEmeraldSDHCRegisterTraceReadCountKey, readCount, 64);
+  setProperty(kEmeraldSDHCRegisterTraceWriteCountKey, writeCount, 64);
+  setProperty(kEmeraldSDHCRegisterTraceCommandCountKey, commandCount, 64);
+  setProperty(kEmeraldSDHCRegisterTraceShadowReadCountKey, shadowReadCount, 64);
+  EMDBGLOG("Traced %llu reads and %llu writes for %llu commands, %llu reads served from shadows",
+           readCount, writeCount, commandCount, shadowReadCount);
+  return kIOReturnSuccess;
+}
+#endif
+
 bool EmeraldSDHC::start(IOService *provider) {
   IOReturn status;
   bool     result = false;
@@ -32,6 +166,17 @@ bool EmeraldSDHC::start(IOService *provider) {
     }
     _device = provider;
     _device->retain();
+    loadQuirks();
+
+#if EMERALDSDHC_REGISTER_REPLAY
+    //
+    // Replay builds serve all register access from the trace in the personality, or an empty register file if there is none.
+    //
+    if (!EmeraldSDHCRegisterAccessReplay::loadTrace(OSDynamicCast(OSData, getProperty(kEmeraldSDHCRegisterReplayKey)))) {
+      EMSYSLOG("Failed to load register replay trace");
+      break;
+    }
+#endif
 
     //
     // Create work loop and interrupt source.
@@ -42,9 +187,14 @@ bool EmeraldSDHC::start(IOService *provider) {
       break;
     }
 
-    _intEventSource = IOInterruptEventSource::interruptEventSource(this,
-                                                                   OSMemberFunctionCast(IOInterruptEventAction, this, &EmeraldSDHC::handleInterrupt),
-                                                                   provider);
+    //
+    // Interrupts are filtered and dispatched to slots in primary interrupt context.
+    // This avoids waking any work loop for shared line interrupts not belonging to the controller.
+    //
+    _intEventSource = IOFilterInterruptEventSource::filterInterruptEventSource(this,
+                                                                               OSMemberFunctionCast(IOInterruptEventAction, this, &EmeraldSDHC::handleInterrupt),
+                                                                               OSMemberFunctionCast(IOFilterInterruptEventSource::Filter, this, &EmeraldSDHC::filterInterrupt),
+                                                                               provider, getInterruptIndex());
     if (_intEventSource == nullptr) {
       EMSYSLOG("Failed to create interrupt event source");
       break;
@@ -54,15 +204,17 @@ bool EmeraldSDHC::start(IOService *provider) {
       EMSYSLOG("Failed to add interrupt event source to work loop with status 0x%X", status);
       break;
     }
-    _intEventSource->enable();
 
     //
     // Probe card slots.
+    // Interrupts are only enabled once all slots are attached and ready to handle them.
     //
     if (!probeCardSlots()) {
       EMSYSLOG("Failed to probe card slots");
       break;
     }
+    _intEventSource->enable();
+    _isIntEnabled = true;
 
     result = true;
     EMDBGLOG("Initialized EmeraldSDHC");
@@ -75,7 +227,9 @@ bool EmeraldSDHC::start(IOService *provider) {
 }
 
 void EmeraldSDHC::stop(IOService *provider) {
+  _isIntEnabled = false;
   if (_intEventSource != nullptr) {
+    _intEventSource->disable();
     _workLoop->removeEventSource(_intEventSource);
     OSSafeReleaseNULL(_intEventSource);
   }
@@ -83,25 +237,125 @@ void EmeraldSDHC::stop(IOService *provider) {
   OSSafeReleaseNULL(_workLoop);
   IOPCIDevice *pciDevice = OSDynamicCast(IOPCIDevice, _device);
   OSSafeReleaseNULL(pciDevice);
+
+#if EMERALDSDHC_REGISTER_REPLAY
+  EmeraldSDHCRegisterAccessReplay::unloadTrace();
+#endif
 }
 
 IOWorkLoop* EmeraldSDHC::getWorkLoop() const {
   return _workLoop;
 }
 
-void EmeraldSDHC::handleInterrupt(OSObject *owner, IOInterruptEventSource *src, int intCount) {
+void EmeraldSDHC::loadQuirks() {
+  IOPCIDevice *pciDevice = OSDynamicCast(IOPCIDevice, _device);
+  OSString    *acpiHid;
+  UInt16      vendorId = 0;
+  UInt16      deviceId = 0;
+
+  if (pciDevice != nullptr) {
+    vendorId = pciDevice->configRead16(kIOPCIConfigVendorID);
+    deviceId = pciDevice->configRead16(kIOPCIConfigDeviceID);
+  }
+
+  //
+  // Match PCI controllers by vendor and device ID, and ACPI controllers by hardware ID.
+  //
+  for (UInt32 i = 0; i < (sizeof (SDHCQuirksTable) / sizeof (SDHCQuirksTable[0])); i++) {
+    if (pciDevice != nullptr) {
+      if (SDHCQuirksTable[i].vendorId != vendorId || SDHCQuirksTable[i].vendorId == 0
+          || (SDHCQuirksTable[i].deviceId != deviceId && SDHCQuirksTable[i].deviceId != kSDHCQuirkMatchAnyDevice)) {
+        continue;
+      }
+    } else {
+      if (SDHCQuirksTable[i].acpiHid == nullptr) {
+        continue;
+      }
+      acpiHid = OSString::withCStringNoCopy(SDHCQuirksTable[i].acpiHid);
+      if (acpiHid == nullptr) {
+        continue;
+      }
+      bool matched = _device->compareName(acpiHid);
+      acpiHid->release();
+      if (!matched) {
+        continue;
+      }
+    }
+
+    _quirks = &SDHCQuirksTable[i];
+    EMSYSLOG("Using quirks for %s", _quirks->name);
+    return;
+  }
+
+  EMDBGLOG("No quirks for controller %04X:%04X", vendorId, deviceId);
+}
+
+int EmeraldSDHC::getInterruptIndex() {
+  int intIndex = 0;
+  int intType;
+
+  //
+  // ACPI-based controllers only have a single interrupt.
+  //
+  if (OSDynamicCast(IOPCIDevice, _device) == nullptr) {
+    return intIndex;
+  }
+
   //
-  // TODO: handle multiple slots.
+  // Prefer message signaled interrupts on PCI controllers if available, otherwise use the legacy interrupt.
   //
-  if (_cardSlotActions[0] != nullptr) {
-    _cardSlotActions[0](_cardSlotTargets[0]);
+  for (int index = 0; _device->getInterruptType(index, &intType) == kIOReturnSuccess; index++) {
+    if (intType & kIOInterruptTypePCIMessaged) {
+      EMDBGLOG("Using MSI interrupt at index %d", index);
+      return index;
+    }
   }
+
+  EMDBGLOG("MSI not supported, using legacy interrupt");
+  return intIndex;
+}
+
+bool EmeraldSDHC::filterInterrupt(IOFilterInterruptEventSource *src) {
+  UInt16 slotIntStatus;
+
+  //
+  // Get slots with pending interrupts.
+  // The slot interrupt status register is common to all slots and can be read from any slot's register space.
+  //
+  // Single slot controllers may not implement this register, always service the only slot for those.
+  //
+  if (_cardSlotCount == 1) {
+    slotIntStatus = BIT0;
+  } else {
+    slotIntStatus = readReg<SDHCRegHostControllerSlotIntStatus>(1);
+  }
+
+  //
+  // Pass interrupt to each pending slot, the slot's own work loop will be woken if there is work to do.
+  //
+  for (UInt32 slot = 0; slot < _cardSlotCount; slot++) {
+    if ((slotIntStatus & (1 << slot)) && _cardSlotNubs[slot] != nullptr) {
+      _cardSlotNubs[slot]->handleHostInterrupt();
+    }
+  }
+
+  //
+  // Controller work loop never needs to be woken.
+  //
+  return false;
+}
+
+void EmeraldSDHC::handleInterrupt(OSObject *owner, IOInterruptEventSource *src, int intCount) {
+  //
+  // All interrupts are handled by the filter and the slot work loops.
+  //
 }
 
 bool EmeraldSDHC::probeCardSlots() {
-  bool         result;
-  OSDictionary *cardSlotDict;
-  OSNumber     *cardSlotNumber;
+  bool            result;
+  OSDictionary    *cardSlotDict;
+  OSNumber        *cardSlotNumber;
+  EmeraldSDHCSlot *cardSlot;
 
   //
   // Get number of active card slots.
@@ -120,8 +374,6 @@ bool EmeraldSDHC::probeCardSlots() {
   bzero(_cardSlotMemoryMaps, sizeof (_cardSlotMemoryMaps));
   bzero(_cardSlotBaseMemory, sizeof (_cardSlotBaseMemory));
   bzero(_cardSlotNubs, sizeof (_cardSlotNubs));
-  bzero(_cardSlotTargets, sizeof (_cardSlotTargets));
-  bzero(_cardSlotActions, sizeof (_cardSlotActions));
 
   //
   // Populate information for each card slot and create nubs.
@@ -142,9 +394,10 @@ bool EmeraldSDHC::probeCardSlots() {
 
     //
     // Allocate card slot nub.
+    // Nub is only published to the interrupt filter once attached.
     //
-    _cardSlotNubs[slot] = OSTypeAlloc(EmeraldSDHCSlot);
-    if (_cardSlotNubs[slot] == nullptr) {
+    cardSlot = OSTypeAlloc(EmeraldSDHCSlot);
+    if (cardSlot == nullptr) {
       EMSYSLOG("Failed to allocate nub for card slot %u", slot + 1);
       return false;
     }
@@ -155,6 +408,7 @@ bool EmeraldSDHC::probeCardSlots() {
     cardSlotNumber = OSNumber::withNumber(slot + 1, 8);
     if (cardSlotNumber == nullptr) {
       EMSYSLOG("Failed to allocate slot number property for card slot %u", slot + 1);
+      cardSlot->release();
       return false;
     }
 
@@ -162,6 +416,7 @@ bool EmeraldSDHC::probeCardSlots() {
     if (cardSlotDict == nullptr) {
       EMSYSLOG("Failed to allocate dictionary for card slot %u", slot + 1);
       cardSlotNumber->release();
+      cardSlot->release();
       return false;
     }
 
@@ -170,29 +425,47 @@ bool EmeraldSDHC::probeCardSlots() {
     if (!result) {
       EMSYSLOG("Failed to add dictionary property for card slot %u", slot + 1);
       cardSlotDict->release();
+      cardSlot->release();
       return false;
     }
 
     //
     // Initialize and attach newly created nub.
     //
-    result = _cardSlotNubs[slot]->init(cardSlotDict) && _cardSlotNubs[slot]->attach(this);
+    result = cardSlot->init(cardSlotDict) && cardSlot->attach(this);
     cardSlotDict->release();
 
     if (!result) {
       EMSYSLOG("Failed to attach nub for card slot %u", slot + 1);
-      OSSafeReleaseNULL(_cardSlotNubs[slot]);
+      cardSlot->release();
       return false;
     }
+    _cardSlotNubs[slot] = cardSlot;
   }
 
   return true;
 }
 
-void EmeraldSDHC::registerCardSlotInterrupt(UInt8 slot, OSObject *target, EmeraldSDHCSlotInterruptAction action) {
+void EmeraldSDHC::detachCardSlot(EmeraldSDHCSlot *cardSlot) {
+  bool hasCardSlots = false;
+
   //
-  // Register interrupt handler for slot.
+  // Stop dispatching interrupts before the slot frees its interrupt state.
+  // Disabling the filter source waits for a running filter to complete.
   //
-  _cardSlotTargets[slot - 1] = target;
-  _cardSlotActions[slot - 1] = action;
+  if (_intEventSource != nullptr) {
+    _intEventSource->disable();
+  }
+
+  for (UInt32 slot = 0; slot < _cardSlotCount; slot++) {
+    if (_cardSlotNubs[slot] == cardSlot) {
+      OSSafeReleaseNULL(_cardSlotNubs[slot]);
+    } else if (_cardSlotNubs[slot] != nullptr) {
+      hasCardSlots = true;
+    }
+  }
+
+  if (hasCardSlots && _isIntEnabled) {
+    _intEventSource->enable();
+  }
 }
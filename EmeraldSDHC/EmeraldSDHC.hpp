@@ -8,16 +8,16 @@
 #ifndef EmeraldSDHC_hpp
 #define EmeraldSDHC_hpp
 
-#include <IOKit/IOInterruptEventSource.h>
+#include <IOKit/IOFilterInterruptEventSource.h>
 #include <IOKit/IOService.h>
 #include <IOKit/pci/IOPCIDevice.h>
 #include <IOKit/acpi/IOACPIPlatformDevice.h>
 
+#include "EmeraldSDHCRegisterAccess.hpp"
 #include "SDMisc.hpp"
+#include "SDRegMap.hpp"
 #include "SDRegs.hpp"
 
-typedef void (*EmeraldSDHCSlotInterruptAction)(void *target);
-
 class EmeraldSDHCSlot;
 
 class EmeraldSDHC : public IOService {
@@ -26,9 +26,11 @@ class EmeraldSDHC : public IOService {
   typedef IOService super;
 
 private:
-  IOService              *_device         = nullptr;
-  IOWorkLoop             *_workLoop       = nullptr;
-  IOInterruptEventSource *_intEventSource = nullptr;
+  IOService                    *_device         = nullptr;
+  IOWorkLoop                   *_workLoop       = nullptr;
+  IOFilterInterruptEventSource *_intEventSource = nullptr;
+  const SDHCQuirks             *_quirks         = nullptr;
+  bool                         _isIntEnabled    = false;
 
   //
   // Child slots.
@@ -38,12 +40,26 @@ private:
   volatile void   *_cardSlotBaseMemory[kSDHCMaximumSlotCount] = { };
   EmeraldSDHCSlot *_cardSlotNubs[kSDHCMaximumSlotCount]       = { };
 
-  OSObject                       *_cardSlotTargets[kSDHCMaximumSlotCount] = { };
-  EmeraldSDHCSlotInterruptAction _cardSlotActions[kSDHCMaximumSlotCount]  = { };
-
+  void loadQuirks();
+  int getInterruptIndex();
+  bool filterInterrupt(IOFilterInterruptEventSource *src);
   void handleInterrupt(OSObject *owner, IOInterruptEventSource *src, int intCount);
   bool probeCardSlots();
 
+#if EMERALDSDHC_REGISTER_REPLAY
+  //
+  // Replay tests, run on request on a separate controller with unattached slots.
+  //
+  bool runReplayTests();
+  bool createReplayTestSlots(UInt32 slotCount);
+  void freeReplayTestSlots();
+  bool checkReplayTest(const char *name, UInt32 entryCount);
+  bool testReplaySlotInterrupts();
+  bool testReplayShadowedRegisters();
+  bool testReplayWaitForBits();
+  bool testReplaySlotInterruptRate(UInt64 *dispatchRate);
+#endif
+
 public:
   //
   // IOService overrides.
@@ -52,34 +68,69 @@ public:
   void stop(IOService *provider) APPLE_KEXT_OVERRIDE;
   IOWorkLoop *getWorkLoop() const APPLE_KEXT_OVERRIDE;
 
+#if EMERALDSDHC_REGISTER_TRACE || EMERALDSDHC_REGISTER_REPLAY
+  IOReturn setProperties(OSObject *properties) APPLE_KEXT_OVERRIDE;
+#endif
+
   //
   // Host controller functions.
+  // Quirks are nullptr if the controller has no known quirks.
+  //
+  inline const SDHCQuirks *getQuirks() { return _quirks; }
+  void detachCardSlot(EmeraldSDHCSlot *cardSlot);
+
+  //
+  // Typed register functions.
+  // Registers are accessed through each slot's register space using the compile-time access policy.
+  // Access width is taken from the register descriptor.
   //
+  template <typename Reg>
+  inline typename Reg::ValueType readReg(UInt8 slot) {
+    return readRegOfWidth(slot, Reg::offset, (typename Reg::ValueType) 0);
+  }
+  template <typename Reg>
+  inline void writeReg(UInt8 slot, typename Reg::ValueType value) {
+    writeRegOfWidth(slot, Reg::offset, value);
+  }
+
+private:
+  //
+  // Raw register access, only used by the typed register functions here and in the slot nubs.
+  //
+  friend class EmeraldSDHCSlot;
+
   inline void writeReg8(UInt8 slot, UInt32 offset, UInt8 value) {
-    *(volatile UInt8 *)((uintptr_t)_cardSlotBaseMemory[slot - 1] + offset) = value;
+    EmeraldSDHCRegisterAccessPolicy::write8(_cardSlotBaseMemory[slot - 1], slot, offset, value);
   }
   inline UInt8 readReg8(UInt8 slot, UInt32 offset) {
-    return *(volatile UInt8 *)((uintptr_t)_cardSlotBaseMemory[slot - 1] + offset);
+    return EmeraldSDHCRegisterAccessPolicy::read8(_cardSlotBaseMemory[slot - 1], slot, offset);
   }
   inline void writeReg16(UInt8 slot, UInt32 offset, UInt16 value) {
-    OSWriteLittleInt16(_cardSlotBaseMemory[slot - 1], offset, value);
+    EmeraldSDHCRegisterAccessPolicy::write16(_cardSlotBaseMemory[slot - 1], slot, offset, value);
   }
   inline UInt16 readReg16(UInt8 slot, UInt32 offset) {
-    return OSReadLittleInt16(_cardSlotBaseMemory[slot - 1], offset);
+    return EmeraldSDHCRegisterAccessPolicy::read16(_cardSlotBaseMemory[slot - 1], slot, offset);
   }
   inline void writeReg32(UInt8 slot, UInt32 offset, UInt32 value) {
-    OSWriteLittleInt32(_cardSlotBaseMemory[slot - 1], offset, value);
+    EmeraldSDHCRegisterAccessPolicy::write32(_cardSlotBaseMemory[slot - 1], slot, offset, value);
   }
   inline UInt32 readReg32(UInt8 slot, UInt32 offset) {
-    return OSReadLittleInt32(_cardSlotBaseMemory[slot - 1], offset);
+    return EmeraldSDHCRegisterAccessPolicy::read32(_cardSlotBaseMemory[slot - 1], slot, offset);
   }
   inline void writeReg64(UInt8 slot, UInt32 offset, UInt64 value) {
-    OSWriteLittleInt64(_cardSlotBaseMemory[slot - 1], offset, value);
+    EmeraldSDHCRegisterAccessPolicy::write64(_cardSlotBaseMemory[slot - 1], slot, offset, value);
   }
   inline UInt64 readReg64(UInt8 slot, UInt32 offset) {
-    return OSReadLittleInt64(_cardSlotBaseMemory[slot - 1], offset);
+    return EmeraldSDHCRegisterAccessPolicy::read64(_cardSlotBaseMemory[slot - 1], slot, offset);
   }
-  void registerCardSlotInterrupt(UInt8 slot, OSObject *target, EmeraldSDHCSlotInterruptAction action);
+  inline UInt8 readRegOfWidth(UInt8 slot, UInt32 offset, UInt8) { return readReg8(slot, offset); }
+  inline UInt16 readRegOfWidth(UInt8 slot, UInt32 offset, UInt16) { return readReg16(slot, offset); }
+  inline UInt32 readRegOfWidth(UInt8 slot, UInt32 offset, UInt32) { return readReg32(slot, offset); }
+  inline UInt64 readRegOfWidth(UInt8 slot, UInt32 offset, UInt64) { return readReg64(slot, offset); }
+  inline void writeRegOfWidth(UInt8 slot, UInt32 offset, UInt8 value) { writeReg8(slot, offset, value); }
+  inline void writeRegOfWidth(UInt8 slot, UInt32 offset, UInt16 value) { writeReg16(slot, offset, value); }
+  inline void writeRegOfWidth(UInt8 slot, UInt32 offset, UInt32 value) { writeReg32(slot, offset, value); }
+  inline void writeRegOfWidth(UInt8 slot, UInt32 offset, UInt64 value) { writeReg64(slot, offset, value); }
 };
 
 #endif
@@ -100,6 +100,11 @@ bool EmeraldSDHCBlockStorageDevice::start(IOService *provider) {
       EMSYSLOG("Failed to initialize sync command lock");
       break;
     }
+    _cardStateLock = IOLockAlloc();
+    if (_cardStateLock == nullptr) {
+      EMSYSLOG("Failed to initialize card state lock");
+      break;
+    }
 
     //
     // Initialize card change thread.
@@ -110,6 +115,15 @@ bool EmeraldSDHCBlockStorageDevice::start(IOService *provider) {
       break;
     }
 
+    //
+    // Initialize re-tuning thread.
+    //
+    _retuneThread = thread_call_allocate(OSMemberFunctionCast(thread_call_func_t, this, &EmeraldSDHCBlockStorageDevice::handleRetune), this);
+    if (_retuneThread == nullptr) {
+      EMSYSLOG("Failed to create re-tuning thread");
+      break;
+    }
+
     //
     // Register interrupt handler.
     //
@@ -132,15 +146,14 @@ bool EmeraldSDHCBlockStorageDevice::start(IOService *provider) {
     _cmdGate->enable();
 
     //
-    // Initialize controller and card.
+    // Initialize controller.
+    // The card is initialized on the card change thread once registered, and starts without media.
     //
     if (!initController()) {
       EMSYSLOG("Failed to initialize SD host controller");
       break;
     }
-    if (!initCard()) {
-      EMSYSLOG("Failed to initialize card");
-    }
+    _isControllerFresh = true;
 
     //
     // Register with the power subsystem.
@@ -155,7 +168,9 @@ bool EmeraldSDHCBlockStorageDevice::start(IOService *provider) {
     registerPowerDriver(this, const_cast<IOPMPowerState*>(powerStates), sizeof(powerStates) / sizeof(powerStates[0]));
 
     setStorageProperties();
+    _isCardInitPending = true;
     registerService();
+    thread_call_enter(_cardChangeThread);
 
     result = true;
     EMDBGLOG("Initialized EmeraldSDHCBlockStorageDevice on slot %u", _cardSlot->getCardSlotId());
@@ -168,21 +183,34 @@ bool EmeraldSDHCBlockStorageDevice::start(IOService *provider) {
 }
 
 void EmeraldSDHCBlockStorageDevice::stop(IOService *provider) {
+  //
+  // Card change and re-tuning threads use the command gate, and must be stopped first.
+  //
+  if (_cardChangeThread != nullptr) {
+    thread_call_cancel_wait(_cardChangeThread);
+    thread_call_free(_cardChangeThread);
+    _cardChangeThread = nullptr;
+  }
+  if (_retuneThread != nullptr) {
+    thread_call_cancel_wait(_retuneThread);
+    thread_call_free(_retuneThread);
+    _retuneThread = nullptr;
+  }
+
   if (_cmdGate != nullptr) {
     getWorkLoop()->removeEventSource(_cmdGate);
     OSSafeReleaseNULL(_cmdGate);
   }
   OSSafeReleaseNULL(_cardSlot);
 
-  if (_cardChangeThread != nullptr) {
-    thread_call_free(_cardChangeThread);
-    _cardChangeThread = nullptr;
-  }
-
   if (_syncCommandLock != nullptr) {
     IOLockFree(_syncCommandLock);
     _syncCommandLock = nullptr;
   }
+  if (_cardStateLock != nullptr) {
+    IOLockFree(_cardStateLock);
+    _cardStateLock = nullptr;
+  }
   
   for (int i = 0; i < kSDAInitialCommandPoolSize; i++) {
     OSSafeReleaseNULL(_initialCommands[i]);
@@ -193,6 +221,8 @@ void EmeraldSDHCBlockStorageDevice::stop(IOService *provider) {
 }
 
 IOReturn EmeraldSDHCBlockStorageDevice::setPowerState(unsigned long powerStateOrdinal, IOService *whatDevice) {
+  bool isCardInitNeeded;
+
   //
   // Handle power state changes.
   //
@@ -200,6 +230,13 @@ IOReturn EmeraldSDHCBlockStorageDevice::setPowerState(unsigned long powerStateOr
     case 0:
       EMDBGLOG("Sleep request received");
       _isMachineSleeping = true;
+
+      //
+      // Put embedded cards to sleep so they can be woken without full initialization.
+      //
+      IOLockLock(_cardStateLock);
+      _isCardAsleep = sleepCard();
+      IOLockUnlock(_cardStateLock);
       break;
 
     case 1:
@@ -208,11 +245,27 @@ IOReturn EmeraldSDHCBlockStorageDevice::setPowerState(unsigned long powerStateOr
       //
       if (_isMachineSleeping) {
         //
-        // Reset controller and card.
+        // Wake card after resetting only the command and data lines, as a full reset would remove power from the sleeping card.
+        // If the card was not asleep or failed to wake, the controller is fully reset and the card initialized on the card change thread,
+        //   so wake is not held up by card initialization. A card still inserted is retried as a failed card.
         //
         EMDBGLOG("Wake request received");
-        initController();
-        initCard();
+        isCardInitNeeded = false;
+        IOLockLock(_cardStateLock);
+        if (!_isCardAsleep || !initController(true) || !awakeCard()) {
+          _isCardReady        = false;
+          _isCardFailed       = _isCardInserted;
+          _cardInitRetryCount = 0;
+          _isCardInitPending  = true;
+          isCardInitNeeded    = true;
+        }
+        _isCardAsleep = false;
+        IOLockUnlock(_cardStateLock);
+
+        if (isCardInitNeeded) {
+          messageClients(kIOMessageMediaStateHasChanged, reinterpret_cast<void*>(kIOMediaStateOffline), 0);
+          thread_call_enter(_cardChangeThread);
+        }
 
         _isMachineSleeping = false;
         EMDBGLOG("Wake request complete");
@@ -317,7 +370,7 @@ IOReturn EmeraldSDHCBlockStorageDevice::reportRemovability(bool *isRemovable) {
 
 IOReturn EmeraldSDHCBlockStorageDevice::reportMaxValidBlock(UInt64 *maxBlock) {
   EMDBGLOG("start");
-  if (!_cardSlot->isCardPresent()) {
+  if (!_isCardReady) {
     return kIOReturnNoMedia;
   }
 
@@ -327,8 +380,12 @@ IOReturn EmeraldSDHCBlockStorageDevice::reportMaxValidBlock(UInt64 *maxBlock) {
 
 IOReturn EmeraldSDHCBlockStorageDevice::reportMediaState(bool *mediaPresent, bool *changedState) {
   EMDBGLOG("start");
-  *mediaPresent = _cardSlot->isCardPresent();
-  *changedState = *mediaPresent != _isCardInserted;
+  //
+  // Only insertion and removal are reported as changes, cards that failed to initialize are retried by the card change thread.
+  // No change is reported while card initialization is queued, the card change thread reports the new state once done.
+  //
+  *mediaPresent = _isCardReady && _cardSlot->isCardPresent();
+  *changedState = !_isCardInitPending && _cardSlot->isCardPresent() != _isCardInserted;
   return kIOReturnSuccess;
 }
 
@@ -378,6 +435,13 @@ IOReturn EmeraldSDHCBlockStorageDevice::doAsyncReadWrite(IOMemoryDescriptor *buf
     }
   }
 
+  //
+  // Card may have failed and be waiting for initialization again.
+  //
+  if (!_isCardReady) {
+    return kIOReturnNoMedia;
+  }
+
   bool isRead = buffer->getDirection() == kIODirectionIn;
 
   //
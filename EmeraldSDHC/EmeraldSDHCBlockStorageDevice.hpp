@@ -31,6 +31,8 @@ typedef struct {
   UInt32              blockSize;
   IOMemoryDescriptor  *memoryDescriptor;
   IOByteCount         memoryDescriptorOffset;
+
+  bool                isRetuneCommand;
 } EmeraldSDHCAsyncCommandArgs;
 
 class EmeraldSDHCBlockStorageDevice : public IOBlockStorageDevice {
@@ -62,12 +64,34 @@ private:
   bool        _isCardEmbedded     = false;
   // SDSC cards use byte addressing for read/write, all others use 32-bit LBA.
   bool        _isCardHighCapacity = false;
-  // Card state changed.
+  // Card is inserted, as last seen by card initialization.
   bool        _isCardInserted     = false;
+  // Card is initialized and can be used for I/O.
+  bool        _isCardReady        = false;
+  // Card is inserted but failed to initialize, and is retried by the card change thread.
+  bool        _isCardFailed       = false;
+  UInt32      _cardInitRetryCount = 0;
+  // Card initialization is queued on the card change thread after start or wake, and has not finished yet.
+  volatile bool _isCardInitPending = false;
   // Card selected.
   bool        _isCardSelected     = false;
   // Max MMC clock speed for standard speed mode.
   UInt32      _mmcMaxStandardClock = 0;
+  // Current timing mode and bus width.
+  SDATimingMode _cardTimingMode   = kSDATimingModeLegacy;
+  SDABusWidth   _cardBusWidth     = kSDABusWidth1;
+  bool          _cardEnhancedStrobe = false;
+  // Identity of the last card probed in this slot, reused when the same card is initialized again.
+  // The parsed CID, CSD, extended CSD, strings, and block count are kept in the card properties below.
+  SDACardType    _cardIdentityType     = kSDACardTypeSD_200;
+  bool           _isCardIdentityValid  = false;
+  bool           _isCardIdentityReused = false;
+  // Time taken by the last initialization that read the full card identity.
+  UInt64         _cardFullInitTimeUs   = 0;
+  // Timing mode last negotiated with the card, restored when the same card is initialized again.
+  SDATimingMode  _timingCacheMode     = kSDATimingModeLegacy;
+  SDABusWidth    _timingCacheBusWidth = kSDABusWidth1;
+  bool           _isTimingCacheValid  = false;
 
   union {
     SDCIDRegister   sd;
@@ -97,18 +121,37 @@ private:
   EmeraldSDHCCommand **_initialCommands = nullptr;
 
   IOLock   *_syncCommandLock      = nullptr;
+  //
+  // Card initialization, re-tuning, and power management all issue sync commands and change card state.
+  // Only one may run at a time, and the sync command state above is only used by the holder of this lock.
+  //
+  IOLock   *_cardStateLock        = nullptr;
   bool     _isSleepingSyncCommand = false;
   IOReturn _syncCommandResult;
 
+  //
+  // Re-tuning state.
+  // Re-tuning is done on a separate thread holding the card state lock, with other commands held in the queue until complete.
+  //
+  thread_call_t _retuneThread      = nullptr;
+  UInt64        _retuneInterval    = 0;
+  UInt64        _retuneDeadline    = 0;
+  bool          _isRetuneNeeded    = false;
+  bool          _isRetuneRequested = false;
+  bool          _isRetuning        = false;
+
   //
   // Power management state.
   //
   bool _isMachineSleeping   = false;
+  // Embedded card was put to sleep with CMD5, and keeps its configuration.
+  bool _isCardAsleep        = false;
 
   //
   // Internal misc functions.
   //
-  void handleInterrupt();
+  void handleInterrupt(UInt16 intStatus, UInt16 errorIntStatus);
+  void processInterrupt(UInt16 intStatus, UInt16 errorIntStatus);
   inline UInt16 calcPower(UInt8 exp) {
     UInt16 value = 1;
     for (int i = 0; i < exp; i++) {
@@ -127,29 +170,66 @@ private:
   // Internal host controller functions.
   //
 
-  bool initController();
+  bool initController(bool softReset = false);
 
   //
   // Thread for card change.
   //
   thread_call_t _cardChangeThread = nullptr;
+  // Controller was reset during start and has not been used since.
+  bool          _isControllerFresh = false;
 
   //
   // Internal card functions.
   //
   void handleCardChange();
+  void handleCardChangeLocked();
+  IOReturn waitForOpCond(UInt32 command, UInt32 argument, SDACommandResponse *response);
+  bool resetMMCCard(UInt32 goIdleTimeout);
   bool resetCard();
+  inline bool isCardIdentityCached(const SDACommandResponse *cidResponse) {
+    return _isCardIdentityValid && _cardIdentityType == _cardType && memcmp(&_cardCID, cidResponse->bytes, sizeof (_cardCID)) == 0;
+  }
   bool probeCard();
+  bool isCardConfigurationUnchanged();
   bool parseCSD();
   bool isExtendedCSDSupported();
   bool parseMMCExtendedCSD();
   bool parseSDSCR();
-  bool setCardBusWidth(SDABusWidth busWidth, bool doubleDataRate);
+  bool setCardBusWidth(SDABusWidth busWidth, bool doubleDataRate, bool enhancedStrobe = false);
   bool switchMMCExtendedCSD(MMCSwitchAccessBits access, UInt8 index, UInt8 value);
+  bool testMMCBusWidth(SDABusWidth busWidth);
+  SDABusWidth detectMMCBusWidth();
+  bool isMMCTimingModeSupported(SDATimingMode timingMode, SDABusWidth busWidth);
+  bool isMMCEnhancedStrobeSupported();
+  bool setMMCTimingMode(SDATimingMode timingMode, SDABusWidth busWidth);
+  bool resetMMCTimingMode();
+  bool verifyMMCTimingMode(SDATimingMode timingMode);
+  bool isMMCSwitchSuccessful();
+  bool restoreMMCTimingMode(SDABusWidth busWidth);
+  UInt8 getMMCPowerClass();
   bool switchMMCSpeed();
   bool tuneCard(SDABusWidth busWidth);
+  inline bool isCardTuned() {
+    return _cardTimingMode == kSDATimingModeHS200 || (_cardTimingMode == kSDATimingModeHS400 && !_cardEnhancedStrobe);
+  }
+  inline bool isRetuneDue() {
+    return _isRetuneNeeded || (_retuneDeadline != 0 && mach_absolute_time() >= _retuneDeadline);
+  }
+  void startRetuneTimer();
+  void requestRetune();
+  bool retuneCard();
+  void handleRetune();
+  IOReturn waitForRetuneGated();
+  IOReturn finishRetuneGated(bool *isCardFailed);
   bool setMMCSpeed(MMCTimingSpeed speed);
+  bool setMMCHostControl2(UInt16 hcControl2);
   bool initCard();
+  UInt32 getMMCSleepAwakeTimeout();
+  UInt32 getMMCSwitchTimeout();
+  bool sleepCard();
+  bool restoreHostTimingMode();
+  bool awakeCard();
 
   //
   // Internal card command functions.
@@ -157,7 +237,8 @@ private:
   EmeraldSDHCCommand *allocatePoolCommand();
   void addCommandToQueue(EmeraldSDHCCommand *command);
   EmeraldSDHCCommand *getNextCommandQueue();
-  void flushCommandQueue();
+  void startNextCommand();
+  void flushCommandQueue(IOReturn status);
   
   void doAsyncIO(UInt16 interruptStatus = 0);
   IOReturn prepareAsyncDataTransfer(EmeraldSDHCCommand *command);
@@ -180,7 +261,7 @@ private:
   IOReturn doAsyncCommandWithData(UInt32 command, UInt32 argument, UInt32 timeout, IOStorageCompletion *completion,
                                   UInt32 blockCount, UInt32 blockCountTotal, UInt32 blockSize,
                                   IOMemoryDescriptor *memoryDescriptor, IOByteCount memoryDescriptorOffset,
-                                  SDACommandResponse *response = nullptr);
+                                  SDACommandResponse *response = nullptr, bool isRetuneCommand = false);
   IOReturn doAsyncCommandGated(EmeraldSDHCAsyncCommandArgs *args);
 
   void setStorageProperties();
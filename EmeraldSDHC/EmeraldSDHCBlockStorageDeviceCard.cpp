@@ -46,32 +46,185 @@ static const SDAVendor MMCVendors[] = {
   { 0x90, "Hynix" }
 };
 
+static const char *getTimingModeString(SDATimingMode timingMode) {
+  switch (timingMode) {
+    case kSDATimingModeLegacy:
+      return "legacy";
+    case kSDATimingModeHighSpeed:
+      return "high speed";
+    case kSDATimingModeDDR52:
+      return "DDR52";
+    case kSDATimingModeHS200:
+      return "HS200";
+    case kSDATimingModeHS400:
+      return "HS400";
+  }
+
+  return "unknown";
+}
+
+static MMCTimingSpeed getMMCTimingSpeed(SDATimingMode timingMode) {
+  switch (timingMode) {
+    case kSDATimingModeHighSpeed:
+    case kSDATimingModeDDR52:
+      return kMMCTimingSpeedHighSpeed;
+    case kSDATimingModeHS200:
+      return kMMCTimingSpeedHS200;
+    case kSDATimingModeHS400:
+      return kMMCTimingSpeedHS400;
+    default:
+      return kMMCTimingSpeedDefault;
+  }
+}
+
+static UInt32 getBusWidthBits(SDABusWidth busWidth) {
+  switch (busWidth) {
+    case kSDABusWidth1:
+      return 1;
+    case kSDABusWidth4:
+      return 4;
+    case kSDABusWidth8:
+      return 8;
+  }
+
+  return 0;
+}
+
+//
+// MMC bus test patterns, the card returns the inverse of the pattern on each connected data line.
+//
+static const UInt8 MMCBusTestPattern8Bit[] = { 0x55, 0xAA, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+static const UInt8 MMCBusTestPattern4Bit[] = { 0x5A, 0x00, 0x00, 0x00 };
+
 void EmeraldSDHCBlockStorageDevice::handleCardChange() {
-  bool cardStatus = false;
-  if (_cardSlot->isCardPresent() == _isCardInserted) {
+  IOLockLock(_cardStateLock);
+  handleCardChangeLocked();
+  _isCardInitPending = false;
+  IOLockUnlock(_cardStateLock);
+}
+
+void EmeraldSDHCBlockStorageDevice::handleCardChangeLocked() {
+  bool   cardStatus    = false;
+  bool   isCardPresent = _cardSlot->isCardPresent();
+  UInt64 retryDeadline;
+
+  if (isCardPresent == _isCardInserted && !_isCardFailed) {
     EMDBGLOG("Card insertion/removal event raised, but state did not change");
     return;
   }
 
   //
   // Handle card insertion/removal.
+  // A card that is still inserted but failed to initialize is retried a limited number of times.
   //
-  if (_cardSlot->isCardPresent()) {
-    EMDBGLOG("Card was inserted");
+  if (isCardPresent != _isCardInserted) {
+    if (isCardPresent) {
+      EMDBGLOG("Card was inserted");
+    } else {
+      EMDBGLOG("Card was removed");
+    }
+    _cardSlot->clearDetectedBusWidth();
+    _cardInitRetryCount = 0;
   } else {
-    EMDBGLOG("Card was removed");
+    if (_cardInitRetryCount >= kSDACardInitMaxRetries) {
+      EMSYSLOG("Card failed to initialize after %u retries", _cardInitRetryCount);
+      return;
+    }
+    _cardInitRetryCount++;
+    EMDBGLOG("Retrying card initialization (%u of %u)", _cardInitRetryCount, kSDACardInitMaxRetries);
   }
 
-  if (!initController()) {
+  //
+  // The controller is already reset on the first bring-up after start.
+  //
+  if (!_isControllerFresh && !initController()) {
     return;
   }
+  _isControllerFresh = false;
+
   cardStatus = initCard();
+  if (cardStatus) {
+    _cardInitRetryCount = 0;
+    setStorageProperties();
+  } else if (_isCardFailed && _cardInitRetryCount < kSDACardInitMaxRetries) {
+    clock_interval_to_deadline(kSDACardInitRetryDelayMs, kMillisecondScale, &retryDeadline);
+    thread_call_enter_delayed(_cardChangeThread, retryDeadline);
+  }
   messageClients(kIOMessageMediaStateHasChanged, reinterpret_cast<void*>(cardStatus ? kIOMediaStateOnline : kIOMediaStateOffline), 0);
 }
 
+IOReturn EmeraldSDHCBlockStorageDevice::waitForOpCond(UInt32 command, UInt32 argument, SDACommandResponse *response) {
+  IOReturn  status;
+  UInt64    startTime;
+  UInt64    elapsedTimeUs;
+  UInt32    pollDelayMs = kSDAOpCondPollInitialMs;
+
+  //
+  // Send op-cond command until the card reports power up has completed.
+  // Polling starts quickly and backs off exponentially, as most cards are ready within a few milliseconds.
+  //
+  startTime = mach_absolute_time();
+  while (true) {
+    status = doSyncCommand(command, argument, kSDATimeout_2sec, response);
+    if (status != kIOReturnSuccess) {
+      return status;
+    }
+
+    elapsedTimeUs = getElapsedTimeUs(startTime);
+    if (response->bytes4[0] & kSDAOCRCardBusy) {
+      EMDBGLOG("Card ready after %llu us", elapsedTimeUs);
+      setProperty(kSDACardReadyTimeKey, elapsedTimeUs, 64);
+      return kIOReturnSuccess;
+    }
+    if (elapsedTimeUs >= (kSDAOpCondTimeoutMs * 1000)) {
+      EMSYSLOG("Card did not complete power up within %u ms", kSDAOpCondTimeoutMs);
+      return kIOReturnNotReady;
+    }
+
+    IOSleep(pollDelayMs);
+    if (pollDelayMs < kSDAOpCondPollMaxMs) {
+      pollDelayMs *= 2;
+    }
+  }
+}
+
+bool EmeraldSDHCBlockStorageDevice::resetMMCCard(UInt32 goIdleTimeout) {
+  IOReturn status;
+  SDACommandResponse resp;
+
+  status = doSyncCommand(kSDCommandGoIdleState, 0, goIdleTimeout);
+  if (status != kIOReturnSuccess) {
+    return false;
+  }
+  EMDBGLOG("Card has been reset and should be in IDLE status");
+
+  //
+  // Send OCR to cards until card startup has completed and bit is set.
+  //
+  status = waitForOpCond(kMMCCommandSendOpCond, kMMCOCRInitValue, &resp);
+  return status == kIOReturnSuccess;
+}
+
 bool EmeraldSDHCBlockStorageDevice::resetCard() {
   IOReturn status;
   SDACommandResponse resp;
+  SDACardType lastCardType;
+
+  //
+  // Embedded slots and slots that last held an MMC card go straight to MMC initialization.
+  // SD probing is only done if the card does not respond as MMC.
+  // Removable slots may now hold an SD card, the MMC attempt uses the short timeout so SD cards are not delayed.
+  //
+  if (_cardSlot->isSlotEmbedded() || (_cardSlot->getLastCardType(&lastCardType) && lastCardType == kSDACardTypeMMC)) {
+    EMDBGLOG("Trying MMC initialization first (%s slot)", _cardSlot->isSlotEmbedded() ? "embedded" : "removable");
+    _cardType = kSDACardTypeMMC;
+    if (resetMMCCard(_cardSlot->isSlotEmbedded() ? kSDATimeout_10sec : kSDATimeout_2sec)) {
+      _cardSlot->setLastCardType(_cardType);
+      EMDBGLOG("Card type %u has been reset successfully and should now be in READY status", _cardType);
+      return true;
+    }
+    EMDBGLOG("Card did not start as MMC, probing for SD card");
+  }
   
   //
   // Assume card installed is a v2 SD card.
@@ -104,28 +257,16 @@ bool EmeraldSDHCBlockStorageDevice::resetCard() {
   // Issue SD card initialization command.
   //
   EMDBGLOG("Initializing %s card", _cardType == kSDACardTypeSD_Legacy ? "MMC or legacy SD" : "SD 2.00");
-  for (int i = 0; i < 20; i++) {
-    status = doSyncCommand(kSDAppCommandSendOpCond, kSDAOCRInitValue, kSDATimeout_2sec, &resp);
-
-    //
-    // No response indicates an MMC card.
-    //
-    if (status == kIOReturnTimeout && _cardType == kSDACardTypeSD_Legacy) {
-      EMDBGLOG("Card did not respond to SEND_OP_COND, not an SD card");
-      _cardType = kSDACardTypeMMC;
-      break;
-    } else if (status != kIOReturnSuccess) {
-      return false;
-    }
-
-    if (resp.bytes4[0] & kSDAOCRCardBusy) {
-      break;
-    }
+  status = waitForOpCond(kSDAppCommandSendOpCond, kSDAOCRInitValue, &resp);
 
-    //
-    // Spec indicates to wait 1sec between attempts.
-    //
-    IOSleep(1000);
+  //
+  // No response indicates an MMC card.
+  //
+  if (status == kIOReturnTimeout && _cardType == kSDACardTypeSD_Legacy) {
+    EMDBGLOG("Card did not respond to SEND_OP_COND, not an SD card");
+    _cardType = kSDACardTypeMMC;
+  } else if (status != kIOReturnSuccess) {
+    return false;
   }
   
   //
@@ -152,24 +293,11 @@ bool EmeraldSDHCBlockStorageDevice::resetCard() {
   //
   // Reset and start MMC card.
   //
-  } else {
-    status = doSyncCommand(kSDCommandGoIdleState, 0, kSDATimeout_10sec);
-    if (status != kIOReturnSuccess) {
-      return false;
-    }
-    EMDBGLOG("Card has been reset again and should be in IDLE status");
-
-    //
-    // Send OCR to cards until card startup has completed and bit is set.
-    //
-    do {
-      status = doSyncCommand(kMMCCommandSendOpCond, 0x00FF8000 | 0x40000000, kSDATimeout_10sec, &resp); // TODO: fix values here
-      if (status != kIOReturnSuccess) {
-        return false;
-      }
-    } while (!(resp.bytes4[0] & BIT31));
+  } else if (!resetMMCCard(kSDATimeout_10sec)) {
+    return false;
   }
 
+  _cardSlot->setLastCardType(_cardType);
   EMDBGLOG("Card type %u has been reset successfully and should now be in READY status", _cardType);
   return true;
 }
@@ -181,6 +309,8 @@ bool EmeraldSDHCBlockStorageDevice::probeCard() {
   SDACommandResponse rcaResponse;
   UInt8 vendorId;
 
+  _isCardIdentityReused = false;
+
   // Instruct all cards to send over CID.
   // Command will time out after all cards have been identified.
   //
@@ -202,9 +332,17 @@ bool EmeraldSDHCBlockStorageDevice::probeCard() {
 
     //
     // Save and parse returned CID.
+    // The identity of the last card probed is reused if the same card has returned.
     //
-    if (!cardFound) {
-      _cardAddress = cardId;
+    if (!cardFound && isCardIdentityCached(&cidResponse)) {
+      _cardAddress          = cardId;
+      _isCardIdentityReused = true;
+      EMDBGLOG("Found same %s card %s %s, using cached identity", isSDCard() ? "SD" : "MMC", _cardVendorName, _cardProductName);
+      cardFound = true;
+    } else if (!cardFound) {
+      _cardAddress         = cardId;
+      _isCardIdentityValid = false;
+      _isTimingCacheValid  = false;
       memcpy(&_cardCID, cidResponse.bytes, sizeof (_cardCID));
 
       //
@@ -287,6 +425,21 @@ bool EmeraldSDHCBlockStorageDevice::probeCard() {
     return false;
   }
 
+  //
+  // The cached identity of a returning card is only used if its write protection and partition configuration are unchanged.
+  // Only the CSD and extended CSD are read again, and no parsing is done.
+  //
+  if (_isCardIdentityReused) {
+    if (isCardConfigurationUnchanged()) {
+      return true;
+    }
+
+    EMDBGLOG("Card configuration changed since last probe, reading identity again");
+    _isCardIdentityReused = false;
+    _isCardIdentityValid  = false;
+    _isTimingCacheValid   = false;
+  }
+
   //
   // Get card CSD structure.
   //
@@ -303,9 +456,58 @@ bool EmeraldSDHCBlockStorageDevice::probeCard() {
     }
   }
 
+  _cardIdentityType    = _cardType;
+  _isCardIdentityValid = true;
   return true;
 }
 
+bool EmeraldSDHCBlockStorageDevice::isCardConfigurationUnchanged() {
+  SDACommandResponse csdResponse;
+  IOReturn           status;
+  bool               isUnchanged;
+
+  //
+  // Temporary and permanent write protection in the CSD can be changed by another host.
+  //
+  if (doSyncCommand(isSDCard() ? (UInt32) kSDCommandSendCSD : (UInt32) kMMCCommandSendCSD,
+                    _cardAddress << kSDARelativeAddressShift, kSDATimeout_10sec, &csdResponse) != kIOReturnSuccess
+      || memcmp(&_cardCSD, csdResponse.bytes, sizeof (_cardCSD)) != 0) {
+    return false;
+  }
+  if (isSDCard() || !isExtendedCSDSupported()) {
+    return true;
+  }
+
+  //
+  // Partitioning, boot and write protection configuration in the extended CSD can also be changed.
+  // This is the only extended CSD read for a returning card, the current timing and power class are kept from it.
+  //
+  IOBufferMemoryDescriptor *bufDescriptor = IOBufferMemoryDescriptor::withCapacity(sizeof (MMCExtendedCSDRegister), kIODirectionIn);
+  if (bufDescriptor == nullptr) {
+    return false;
+  }
+  bufDescriptor->prepare();
+
+  status = doSyncCommandWithData(kMMCCommandSendExtCSD, 0, kSDATimeout_10sec, 1, sizeof (MMCExtendedCSDRegister), bufDescriptor, 0);
+  const MMCExtendedCSDRegister *extCSD = (const MMCExtendedCSDRegister*) bufDescriptor->getBytesNoCopy();
+  isUnchanged = status == kIOReturnSuccess
+    && extCSD->partitionConfig           == _mmcExtendedCSD.partitionConfig
+    && extCSD->bootConfigProtection      == _mmcExtendedCSD.bootConfigProtection
+    && extCSD->bootWriteProtection       == _mmcExtendedCSD.bootWriteProtection
+    && extCSD->bootWriteProtectionStatus == _mmcExtendedCSD.bootWriteProtectionStatus
+    && extCSD->userWriteProtection       == _mmcExtendedCSD.userWriteProtection
+    && extCSD->eraseGroupDef             == _mmcExtendedCSD.eraseGroupDef
+    && extCSD->rpmbSizeMult              == _mmcExtendedCSD.rpmbSizeMult
+    && extCSD->sectorCount               == _mmcExtendedCSD.sectorCount;
+  if (isUnchanged) {
+    memcpy(&_mmcExtendedCSD, extCSD, sizeof (_mmcExtendedCSD));
+  }
+
+  bufDescriptor->complete();
+  bufDescriptor->release();
+  return isUnchanged;
+}
+
 bool EmeraldSDHCBlockStorageDevice::parseCSD() {
   //
   // Get CSD structure from card.
@@ -459,8 +661,9 @@ bool EmeraldSDHCBlockStorageDevice::parseSDSCR() {
   return true;
 }
 
-bool EmeraldSDHCBlockStorageDevice::setCardBusWidth(SDABusWidth busWidth, bool doubleDataRate) {
-  UInt8 busWidthBits;
+bool EmeraldSDHCBlockStorageDevice::setCardBusWidth(SDABusWidth busWidth, bool doubleDataRate, bool enhancedStrobe) {
+  UInt8  busWidthBits;
+  UInt64 startTime = mach_absolute_time();
   if (isSDCard()) {
     //
     // Set SD bus width.
@@ -494,6 +697,9 @@ bool EmeraldSDHCBlockStorageDevice::setCardBusWidth(SDABusWidth busWidth, bool d
     if (doubleDataRate) {
       busWidthBits |= kMMCBusWidthDDR;
     }
+    if (enhancedStrobe) {
+      busWidthBits |= kMMCBusWidthEnhancedStrobe;
+    }
 
     EMDBGLOG("Setting MMC bus width to 0x%X", busWidthBits);
     if (!switchMMCExtendedCSD (kMMCSwitchAccessWriteByte, __offsetof(MMCExtendedCSDRegister, busWidth), busWidthBits)) {
@@ -506,7 +712,7 @@ bool EmeraldSDHCBlockStorageDevice::setCardBusWidth(SDABusWidth busWidth, bool d
   // Controller bus width needs to also be set to match card.
   //
   _cardSlot->setControllerBusWidth(busWidth);
-  IOSleep(50);
+  EMDBGLOG("Bus width changed in %llu us", getElapsedTimeUs(startTime));
   return true;
 }
 
@@ -515,35 +721,458 @@ bool EmeraldSDHCBlockStorageDevice::switchMMCExtendedCSD(MMCSwitchAccessBits acc
   UInt32 arg = ((access << kMMCSwitchAccessShift) & kMMCSwitchAccessMask)
     | ((index << kMMCSwitchIndexShift) & kMMCSwitchIndexMask)
     | ((value << kMMCSwitchValueShift) & kMMCSwitchValueMask);
-  return doSyncCommand(kMMCCommandSwitch, arg, kSDATimeout_10sec) == kIOReturnSuccess;
+  if (doSyncCommand(kMMCCommandSwitch, arg, kSDATimeout_10sec) != kIOReturnSuccess) {
+    return false;
+  }
+
+  //
+  // Card is busy until the switch has completed, for up to the switch time reported by the card.
+  //
+  return _cardSlot->waitForCardIdle(getMMCSwitchTimeout() * 1000);
 }
 
-bool EmeraldSDHCBlockStorageDevice::switchMMCSpeed() {
-  /*SDABusWidth busWidth;
-  MMCTimingSpeed speed;
+UInt32 EmeraldSDHCBlockStorageDevice::getMMCSwitchTimeout() {
+  //
+  // All fields switched by this driver use the generic CMD6 timeout.
+  // Cards before eMMC 4.5 do not define it.
+  //
+  if (_mmcExtendedCSD.genericCMD6Timeout == 0) {
+    return kMMCGenericCMD6TimeoutDefault;
+  }
+  return _mmcExtendedCSD.genericCMD6Timeout * kMMCGenericCMD6TimeoutUnitMs;
+}
+
+bool EmeraldSDHCBlockStorageDevice::testMMCBusWidth(SDABusWidth busWidth) {
+  const UInt8 *pattern;
+  const UInt8 *readBytes;
+  UInt32      patternLength;
+  bool        result = true;
+
+  if (busWidth == kSDABusWidth8) {
+    pattern       = MMCBusTestPattern8Bit;
+    patternLength = sizeof (MMCBusTestPattern8Bit);
+  } else if (busWidth == kSDABusWidth4) {
+    pattern       = MMCBusTestPattern4Bit;
+    patternLength = sizeof (MMCBusTestPattern4Bit);
+  } else {
+    return false;
+  }
+
+  if (!setCardBusWidth(busWidth, false)) {
+    return false;
+  }
 
   //
-  // Set speed to max supported.
+  // Setup transfer blocks for the outgoing pattern and the incoming inverted pattern.
   //
-  if (_mmcExtendedCSD.deviceType & (kMMCDeviceTypeHS400_DDR_1_2V | kMMCDeviceTypeHS400_DDR_1_8V)) {
-    busWidth = kSDABusWidth8;
-    speed = kMMCTimingSpeedHS200;
-  } else if (_mmcExtendedCSD.deviceType & (kMMCDeviceTypeHS200_SDR_1_2V | kMMCDeviceTypeHS200_SDR_1_8V)) {
+  IOBufferMemoryDescriptor *writeDescriptor = IOBufferMemoryDescriptor::withCapacity(patternLength, kIODirectionOut);
+  IOBufferMemoryDescriptor *readDescriptor  = IOBufferMemoryDescriptor::withCapacity(patternLength, kIODirectionIn);
+  if (writeDescriptor == nullptr || readDescriptor == nullptr) {
+    OSSafeReleaseNULL(writeDescriptor);
+    OSSafeReleaseNULL(readDescriptor);
+    return false;
+  }
+  memcpy(writeDescriptor->getBytesNoCopy(), pattern, patternLength);
+  bzero(readDescriptor->getBytesNoCopy(), patternLength);
+  writeDescriptor->prepare();
+  readDescriptor->prepare();
+
+  //
+  // Send the pattern with BUS_TEST_W, then read back the inverted pattern with BUS_TEST_R.
+  // Data CRC and timeout errors are expected on these commands and are ignored by the interrupt handler,
+  //   only the returned pattern decides if the bus width works.
+  //
+  IOReturn status = doSyncCommandWithData(kMMCCommandBusTestWrite, 0, kSDATimeout_100ms, 1, patternLength, writeDescriptor, 0);
+  if (status == kIOReturnSuccess) {
+    status = doSyncCommandWithData(kMMCCommandBusTestRead, 0, kSDATimeout_100ms, 1, patternLength, readDescriptor, 0);
+  }
+  writeDescriptor->complete();
+  readDescriptor->complete();
+
+  if (status != kIOReturnSuccess) {
+    EMDBGLOG("Bus test for %u-bit bus failed with status 0x%X", getBusWidthBits(busWidth), status);
+    _cardSlot->resetController(kSDHCRegSoftwareResetCmd);
+    _cardSlot->resetController(kSDHCRegSoftwareResetDat);
+    result = false;
+  }
+
+  //
+  // Only the first bus width / 4 bytes carry the pattern, the rest of the reply is ignored.
+  //
+  readBytes = (const UInt8*) readDescriptor->getBytesNoCopy();
+  for (UInt32 i = 0; result && i < patternLength / 4; i++) {
+    if ((pattern[i] ^ readBytes[i]) != 0xFF) {
+      EMDBGLOG("Bus test for %u-bit bus returned 0x%X for pattern 0x%X", getBusWidthBits(busWidth), readBytes[i], pattern[i]);
+      result = false;
+    }
+  }
+
+  writeDescriptor->release();
+  readDescriptor->release();
+  return result;
+}
+
+SDABusWidth EmeraldSDHCBlockStorageDevice::detectMMCBusWidth() {
+  SDABusWidth busWidth;
+
+  //
+  // Bus test only needs to be done once for each card, the result is kept by the slot across resume.
+  //
+  if (_cardSlot->getDetectedBusWidth(&busWidth)) {
+    EMDBGLOG("Using previously detected %u-bit bus", getBusWidthBits(busWidth));
+    return busWidth;
+  }
+
+  //
+  // Try the widest bus width supported by the host controller first.
+  // The controller may report 8-bit support on boards that only route 4 data lines.
+  //
+  busWidth = kSDABusWidth1;
+  if ((_cardSlot->getControllerCapabilities() & kSDHCRegCapabilitiesEmbedded8BitSupported) && testMMCBusWidth(kSDABusWidth8)) {
     busWidth = kSDABusWidth8;
-    speed = kMMCTimingSpeedHS200;
-  } else if (_mmcExtendedCSD.deviceType & (kMMCDeviceTypeHighSpeed_DDR_52MHz_1_2V | kMMCDeviceTypeHighSpeed_DDR_52MHz_1_8V_3V)) {
-    
-  }*/
+  } else if (testMMCBusWidth(kSDABusWidth4)) {
+    busWidth = kSDABusWidth4;
+  }
 
-  setCardBusWidth(kSDABusWidth8, false);
+  //
+  // Return to 1-bit bus, the bus width is set again with the timing mode.
+  //
+  if (!setCardBusWidth(kSDABusWidth1, false)) {
+    return kSDABusWidth1;
+  }
 
-  setMMCSpeed(kMMCTimingSpeedHS200);
-  _cardSlot->setControllerClock(200 * MHz);
-  
-  tuneCard(kSDABusWidth8);
+  EMDBGLOG("Bus test detected %u-bit bus", getBusWidthBits(busWidth));
+  _cardSlot->setDetectedBusWidth(busWidth);
+  return busWidth;
+}
+
+bool EmeraldSDHCBlockStorageDevice::isMMCTimingModeSupported(SDATimingMode timingMode, SDABusWidth busWidth) {
+  UInt64 hostCaps   = _cardSlot->getControllerCapabilities();
+  UInt8  deviceType = _mmcExtendedCSD.deviceType;
+
+  if (timingMode > _cardSlot->getMaxTimingMode()) {
+    return false;
+  }
+
+  //
+  // Both the card and the host controller must support the mode.
+  // Only 1.8V signaling is supported by the host controller for HS200 and HS400.
+  //
+  switch (timingMode) {
+    case kSDATimingModeHS400:
+      //
+      // HS400 is only defined for an 8-bit bus, and is entered through HS200 unless enhanced strobe is used.
+      //
+      return (deviceType & kMMCDeviceTypeHS400_DDR_1_8V)
+        && busWidth == kSDABusWidth8
+        && (isMMCTimingModeSupported(kSDATimingModeHS200, busWidth) || isMMCEnhancedStrobeSupported());
+
+    case kSDATimingModeDDR52:
+      //
+      // The host controller only defines DDR50 with 1.8V signaling, cards that only support DDR at 1.2V are not supported.
+      // DDR bus widths are only defined for 4-bit and 8-bit buses.
+      //
+      return (deviceType & kMMCDeviceTypeHighSpeed_DDR_52MHz_1_8V_3V)
+        && _cardSlot->getControllerVersion() >= kSDHostControllerVersion3_00
+        && (hostCaps & kSDHCRegCapabilitiesDDR50Supported)
+        && busWidth != kSDABusWidth1;
+
+    case kSDATimingModeHS200:
+      return (deviceType & kMMCDeviceTypeHS200_SDR_1_8V)
+        && _cardSlot->getControllerVersion() >= kSDHostControllerVersion3_00
+        && (hostCaps & kSDHCRegCapabilitiesSDR104Supported)
+        && busWidth != kSDABusWidth1;
+
+    case kSDATimingModeHighSpeed:
+      return (deviceType & (kMMCDeviceTypeHighSpeed_26MHz | kMMCDeviceTypeHighSpeed_52MHz))
+        && (hostCaps & kSDHCRegCapabilitiesHighSpeedSupported);
+
+    case kSDATimingModeLegacy:
+      return true;
+  }
+
+  return false;
+}
+
+bool EmeraldSDHCBlockStorageDevice::isMMCEnhancedStrobeSupported() {
+  return _mmcExtendedCSD.strobeSupport != 0
+    && _cardSlot->isEnhancedStrobeSupported()
+    && _cardSlot->getControllerVersion() >= kSDHostControllerVersion3_00;
+}
+
+bool EmeraldSDHCBlockStorageDevice::setMMCTimingMode(SDATimingMode timingMode, SDABusWidth busWidth) {
+  UInt32 clockSpeed;
+
+  switch (timingMode) {
+    case kSDATimingModeHS400:
+      if (isMMCEnhancedStrobeSupported()) {
+        //
+        // With enhanced strobe the card drives the data strobe for both commands and data, and no tuning is needed.
+        // The card is switched directly from high speed to HS400, with the host at 1.8V signaling from the start
+        //   as in the HS200 path.
+        //
+        _cardEnhancedStrobe = setMMCHostControl2(_cardSlot->getHostControl2() | kSDHCRegHostControl21_8VSignaling)
+          && setMMCSpeed(kMMCTimingSpeedHighSpeed)
+          && _cardSlot->setControllerClock(kSDAHighSpeedClock52MHz)
+          && setCardBusWidth(busWidth, true, true);
+        if (!_cardEnhancedStrobe) {
+          return false;
+        }
+        _cardSlot->setControllerEnhancedStrobe(true);
+      } else {
+        //
+        // HS400 sampling is tuned in HS200, then the card is switched back to high speed at 52 MHz
+        //   before changing to an 8-bit DDR bus. The tuning result is retained by the host controller.
+        //
+        if (!setMMCTimingMode(kSDATimingModeHS200, busWidth)
+            || !setMMCSpeed(kMMCTimingSpeedHighSpeed)
+            || !_cardSlot->setControllerClock(kSDAHighSpeedClock52MHz)
+            || !setCardBusWidth(busWidth, true)) {
+          return false;
+        }
+      }
+      return setMMCSpeed(kMMCTimingSpeedHS400)
+        && _cardSlot->setControllerClock(kSDAHS200Clock200MHz);
+
+    case kSDATimingModeDDR52:
+      //
+      // DDR52 uses high speed timing on the card with a DDR bus width, which can only be selected in high speed.
+      // The host controller is then switched to DDR50, and the clock set again so the DDR50 preset can be used.
+      //
+      return setMMCSpeed(kMMCTimingSpeedHighSpeed)
+        && _cardSlot->setControllerClock(kSDAHighSpeedClock52MHz)
+        && setCardBusWidth(busWidth, true)
+        && setMMCHostControl2(SDHCRegHostControl2UHSMode::set(_cardSlot->getHostControl2() | kSDHCRegHostControl21_8VSignaling,
+                                                              kSDHCRegHostControl2UHS_DDR50))
+        && _cardSlot->setControllerClock(kSDAHighSpeedClock52MHz);
+
+    case kSDATimingModeHS200:
+      //
+      // Bus width must be set before switching to HS200, tuning is then done at the full clock.
+      //
+      return setCardBusWidth(busWidth, false)
+        && setMMCSpeed(kMMCTimingSpeedHS200)
+        && _cardSlot->setControllerClock(kSDAHS200Clock200MHz)
+        && tuneCard(busWidth);
+
+    case kSDATimingModeHighSpeed:
+      clockSpeed = (_mmcExtendedCSD.deviceType & kMMCDeviceTypeHighSpeed_52MHz) ? kSDAHighSpeedClock52MHz : kSDANormalSpeedClock26MHz;
+      return setMMCSpeed(kMMCTimingSpeedHighSpeed)
+        && _cardSlot->setControllerClock(clockSpeed)
+        && setCardBusWidth(busWidth, false);
+
+    case kSDATimingModeLegacy:
+      return setCardBusWidth(busWidth, false);
+
+    default:
+      return false;
+  }
+}
+
+bool EmeraldSDHCBlockStorageDevice::resetMMCTimingMode() {
+  //
+  // Return card and host controller to legacy timing and 1-bit bus at the standard clock.
+  // The card accepts commands at a lower clock in any timing mode.
+  //
+  if (!_cardSlot->setControllerClock(_mmcMaxStandardClock)) {
+    return false;
+  }
+  _cardSlot->setControllerEnhancedStrobe(false);
+  _cardEnhancedStrobe = false;
+  return setMMCSpeed(kMMCTimingSpeedDefault) && setCardBusWidth(kSDABusWidth1, false);
+}
+
+bool EmeraldSDHCBlockStorageDevice::verifyMMCTimingMode(SDATimingMode timingMode) {
+  //
+  // Read the extended CSD in the new timing mode, and check the card is using the expected timing.
+  //
+  IOBufferMemoryDescriptor *bufDescriptor = IOBufferMemoryDescriptor::withCapacity(sizeof (MMCExtendedCSDRegister), kIODirectionIn);
+  if (bufDescriptor == nullptr) {
+    return false;
+  }
+  bufDescriptor->prepare();
+
+  IOReturn status     = doSyncCommandWithData(kMMCCommandSendExtCSD, 0, kSDATimeout_10sec, 1, sizeof (MMCExtendedCSDRegister), bufDescriptor, 0);
+  UInt8    hsTiming   = ((MMCExtendedCSDRegister*) bufDescriptor->getBytesNoCopy())->hsTiming;
+  UInt8    powerClass = ((MMCExtendedCSDRegister*) bufDescriptor->getBytesNoCopy())->powerClass;
+
+  bufDescriptor->complete();
+  bufDescriptor->release();
+
+  if (status != kIOReturnSuccess) {
+    EMDBGLOG("Failed to read extended CSD in timing mode %s with status 0x%X", getTimingModeString(timingMode), status);
+    return false;
+  }
+
+  //
+  // Timing and power class are the only extended CSD fields changed by this driver, the rest is kept from the last full read.
+  //
+  _mmcExtendedCSD.hsTiming   = hsTiming;
+  _mmcExtendedCSD.powerClass = powerClass;
+
+  if ((hsTiming & kMMCHSTimingSpeedMask) != getMMCTimingSpeed(timingMode)) {
+    EMDBGLOG("Card reported timing 0x%X in timing mode %s", hsTiming, getTimingModeString(timingMode));
+    return false;
+  }
+  return true;
+}
+
+bool EmeraldSDHCBlockStorageDevice::isMMCSwitchSuccessful() {
+  SDACommandResponse statusResponse;
+
+  //
+  // Card reports a switch it could not apply in its status, without needing an extended CSD read.
+  //
+  if (doSyncCommand(kMMCCommandSendStatus, _cardAddress << kSDARelativeAddressShift, kSDATimeout_10sec, &statusResponse) != kIOReturnSuccess) {
+    return false;
+  }
+  return (statusResponse.bytes4[0] & kMMCCardStatusSwitchError) == 0;
+}
+
+bool EmeraldSDHCBlockStorageDevice::restoreMMCTimingMode(SDABusWidth busWidth) {
+  UInt64 startTime = mach_absolute_time();
+
+  //
+  // Only restore the timing mode for the same card with the same bus width.
+  // Timing was verified when first negotiated, the card status is enough to check the switches were applied.
+  //
+  if (!_isTimingCacheValid || !_isCardIdentityReused || _timingCacheBusWidth != busWidth
+      || !isMMCTimingModeSupported(_timingCacheMode, busWidth)) {
+    return false;
+  }
+
+  EMDBGLOG("Restoring timing mode %s with %u-bit bus", getTimingModeString(_timingCacheMode), getBusWidthBits(busWidth));
+  if (setMMCTimingMode(_timingCacheMode, busWidth) && isMMCSwitchSuccessful()) {
+    _cardTimingMode = _timingCacheMode;
+    EMDBGLOG("Timing mode restored in %llu us", getElapsedTimeUs(startTime));
+    return true;
+  }
+
+  //
+  // Card will be renegotiated from legacy timing.
+  //
+  EMSYSLOG("Failed to restore timing mode %s, renegotiating", getTimingModeString(_timingCacheMode));
+  _isTimingCacheValid = false;
+  resetMMCTimingMode();
+  return false;
+}
+
+UInt8 EmeraldSDHCBlockStorageDevice::getMMCPowerClass() {
+  UInt8 powerClasses;
+
+  //
+  // Power class only applies to 4-bit and 8-bit buses.
+  //
+  if (_cardBusWidth == kSDABusWidth1) {
+    return 0;
+  }
+
+  //
+  // Power class depends on the card supply voltage (VCC) and the clock rate of the timing mode.
+  //
+  // The 200 MHz classes are given for the I/O voltage (VCCQ) instead, HS200 and HS400 always use 1.8V signaling.
+  // The 1.3V class is for 1.2V signaling, which is not used. There is no HS400 class for 1.95V VCC, the 200 MHz class is used.
+  //
+  bool isLowVoltage = (_cardSlot->getPowerControl() & kSDHCRegPowerControlVDD1_Mask) == kSDHCRegPowerControlVDD1_1_8;
+  switch (_cardTimingMode) {
+    case kSDATimingModeHS400:
+      powerClasses = isLowVoltage ? _mmcExtendedCSD.powerCL_200_195 : _mmcExtendedCSD.powerCL_DDR_200_360;
+      break;
+
+    case kSDATimingModeHS200:
+      powerClasses = _mmcExtendedCSD.powerCL_200_195;
+      break;
+
+    case kSDATimingModeDDR52:
+      powerClasses = isLowVoltage ? _mmcExtendedCSD.powerCL_DDR_52_195 : _mmcExtendedCSD.powerCL_DDR_52_360;
+      break;
+
+    case kSDATimingModeHighSpeed:
+      if (_mmcExtendedCSD.deviceType & kMMCDeviceTypeHighSpeed_52MHz) {
+        powerClasses = isLowVoltage ? _mmcExtendedCSD.powerCL_52_195 : _mmcExtendedCSD.powerCL_52_360;
+        break;
+      }
+      // Fall through.
+
+    default:
+      powerClasses = isLowVoltage ? _mmcExtendedCSD.powerCL_26_195 : _mmcExtendedCSD.powerCL_26_360;
+      break;
+  }
+
+  if (_cardBusWidth == kSDABusWidth8) {
+    return (powerClasses & kMMCPowerClass8BitMask) >> kMMCPowerClass8BitShift;
+  }
+  return powerClasses & kMMCPowerClass4BitMask;
+}
+
+bool EmeraldSDHCBlockStorageDevice::switchMMCSpeed() {
+  SDABusWidth   busWidth;
+  SDATimingMode timingMode;
+  UInt8         powerClass;
+  bool          isStateCurrent = false;
+  UInt64        hostCaps = _cardSlot->getControllerCapabilities();
+
+  //
+  // Use widest bus width that passes the bus test.
+  //
+  busWidth = detectMMCBusWidth();
+
+  //
+  // Restore the timing mode previously negotiated with this card if possible.
+  // Otherwise try each timing mode supported by both the card and host controller from fastest to slowest.
+  // Any failure returns the card to legacy timing and tries the next mode.
+  //
+  if (restoreMMCTimingMode(busWidth)) {
+    timingMode     = _cardTimingMode;
+    isStateCurrent = true;
+  } else {
+    for (timingMode = kSDATimingModeHS400; timingMode > kSDATimingModeLegacy; timingMode = (SDATimingMode) (timingMode - 1)) {
+      if (!isMMCTimingModeSupported(timingMode, busWidth)) {
+        continue;
+      }
+
+      EMDBGLOG("Trying timing mode %s with %u-bit bus", getTimingModeString(timingMode), getBusWidthBits(busWidth));
+      if (setMMCTimingMode(timingMode, busWidth)) {
+        break;
+      }
+
+      EMSYSLOG("Failed to switch to timing mode %s, falling back", getTimingModeString(timingMode));
+      if (!resetMMCTimingMode()) {
+        EMSYSLOG("Failed to return card to legacy timing");
+        return false;
+      }
+    }
+
+    if (timingMode == kSDATimingModeLegacy && !setMMCTimingMode(kSDATimingModeLegacy, busWidth)) {
+      EMSYSLOG("Failed to set %u-bit bus width, using 1-bit bus", getBusWidthBits(busWidth));
+      busWidth = kSDABusWidth1;
+    }
+
+    _timingCacheMode     = timingMode;
+    _timingCacheBusWidth = busWidth;
+    _isTimingCacheValid  = true;
+  }
+
+  _cardTimingMode = timingMode;
+  _cardBusWidth   = busWidth;
+  EMSYSLOG("Card is running in timing mode %s%s with %u-bit bus", getTimingModeString(_cardTimingMode),
+           _cardEnhancedStrobe ? " (enhanced strobe)" : "", getBusWidthBits(_cardBusWidth));
+
+  //
+  // Raise the power class to match the timing mode and bus width, the card may otherwise limit its performance.
+  // The default power class is 0, and the card keeps running at the default if the switch fails.
+  //
+  powerClass = getMMCPowerClass();
+  if (powerClass != (_mmcExtendedCSD.powerClass & kMMCPowerClassMask)) {
+    EMDBGLOG("Setting power class to %u", powerClass);
+    if (switchMMCExtendedCSD(kMMCSwitchAccessWriteByte, __offsetof(MMCExtendedCSDRegister, powerClass), powerClass)
+        && isMMCSwitchSuccessful()) {
+      _mmcExtendedCSD.powerClass = powerClass;
+    } else {
+      EMSYSLOG("Failed to set power class to %u", powerClass);
+    }
+  }
 
-  
-  UInt64 hostCaps = _cardSlot->getControllerCapabilities();
   EMDBGLOG("Host controller slot capabilities: 0x%llX", hostCaps);
 
   //
@@ -562,8 +1191,20 @@ bool EmeraldSDHCBlockStorageDevice::switchMMCSpeed() {
   EMDBGLOG("No DMA support, using PIO");
   _cardSlot->setControllerDMAMode(_hcTransferType);
   
-  memset(&_mmcExtendedCSD, 0, sizeof (_mmcExtendedCSD));
-  parseMMCExtendedCSD();
+  //
+  // Read back the timing and power class of a newly negotiated timing mode.
+  // A restored timing mode was checked through the card status instead.
+  //
+  if (!isStateCurrent && !verifyMMCTimingMode(timingMode)) {
+    EMSYSLOG("Card is not reporting timing mode %s", getTimingModeString(timingMode));
+  }
+  if ((_mmcExtendedCSD.powerClass & kMMCPowerClassMask) != powerClass) {
+    EMSYSLOG("Card is using power class %u instead of %u", _mmcExtendedCSD.powerClass & kMMCPowerClassMask, powerClass);
+  }
+  setProperty(kSDACardPowerClassKey, _mmcExtendedCSD.powerClass & kMMCPowerClassMask, 8);
+  setProperty(kSDACardPowerClassSelectedKey, powerClass, 8);
+
+  startRetuneTimer();
 
   return true;
 }
@@ -591,16 +1232,31 @@ bool EmeraldSDHCBlockStorageDevice::tuneCard(SDABusWidth busWidth) {
 
   //
   // Perform tuning between host controller and card.
+  // Host controller clears execute tuning when done, and sets sampling clock select only if tuning succeeded.
   //
   EMDBGLOG("Starting tuning of card using %u bytes", bytesLength);
-  _cardSlot->writeReg16(kSDHCRegHostControl2, _cardSlot->readReg16(kSDHCRegHostControl2) | kSDHCRegHostControl2ExecuteTuning);
-  while (_cardSlot->readReg16(kSDHCRegHostControl2) & kSDHCRegHostControl2ExecuteTuning) {
-    if (doSyncCommandWithData(kMMCCommandSendTuningBlock, 0, kSDATimeout_10sec, 1, bytesLength, bufDescriptor, 0) != kIOReturnSuccess) {
+  _cardSlot->setHostControl2(_cardSlot->getHostControl2() | kSDHCRegHostControl2ExecuteTuning);
+  for (int loop = 0; _cardSlot->readReg<SDHCRegHostControl2>() & kSDHCRegHostControl2ExecuteTuning; loop++) {
+    if (loop >= kSDATuneMaxLoops
+        || doSyncCommandWithData(kMMCCommandSendTuningBlock, 0, kSDATimeout_10sec, 1, bytesLength, bufDescriptor, 0) != kIOReturnSuccess) {
       tuningComplete = false;
       break;
     }
   }
-  EMDBGLOG("Tuning complete: %u", tuningComplete); // TODO: handle tuning error interrupts?
+  _cardSlot->reloadHostControl2();
+  if ((_cardSlot->getHostControl2() & kSDHCRegHostControl2SamplingClockSelect) == 0) {
+    tuningComplete = false;
+  }
+
+  //
+  // Tuning errors and CRC errors on a tuning block fail the command and end tuning as failed.
+  // Re-tune requests raised by those errors are cleared when the re-tuning timer is restarted.
+  // Reset tuning circuit on failure.
+  //
+  if (!tuningComplete) {
+    _cardSlot->setHostControl2(_cardSlot->getHostControl2() & ~(kSDHCRegHostControl2ExecuteTuning | kSDHCRegHostControl2SamplingClockSelect));
+  }
+  EMDBGLOG("Tuning complete: %u", tuningComplete);
 
   bufDescriptor->complete();
   bufDescriptor->release();
@@ -608,49 +1264,211 @@ bool EmeraldSDHCBlockStorageDevice::tuneCard(SDABusWidth busWidth) {
   return tuningComplete;
 }
 
+void EmeraldSDHCBlockStorageDevice::startRetuneTimer() {
+  UInt64 hostCaps = _cardSlot->getControllerCapabilities();
+  UInt8  timerCount;
+
+  _isRetuneNeeded = false;
+  _retuneInterval = 0;
+  _retuneDeadline = 0;
+  if (!isCardTuned()) {
+    return;
+  }
+
+  //
+  // Re-tuning timer count is 2^(N-1) seconds, 0 disables the timer.
+  // Reserved and other source values are treated as no timer.
+  // Re-tuning is still done on re-tuning events and CRC errors if the timer is disabled.
+  //
+  timerCount = SDHCRegCapabilitiesRetuningTimer::get(hostCaps);
+  if (timerCount != 0 && timerCount <= kSDHCRegCapabilitiesRetuningTimerMax) {
+    clock_interval_to_absolutetime_interval(1U << (timerCount - 1), kSecondScale, &_retuneInterval);
+    _retuneDeadline = mach_absolute_time() + _retuneInterval;
+  }
+  EMDBGLOG("Re-tuning timer count 0x%X, mode %u", timerCount, (UInt32) SDHCRegCapabilitiesRetuningMode::get(hostCaps));
+}
+
+void EmeraldSDHCBlockStorageDevice::requestRetune() {
+  if (_isRetuneRequested || !isCardTuned()) {
+    return;
+  }
+
+  //
+  // Commands are only held once the re-tuning thread owns the card state.
+  //
+  EMDBGLOG("Re-tuning requested");
+  _isRetuneRequested = true;
+  thread_call_enter(_retuneThread);
+}
+
+bool EmeraldSDHCBlockStorageDevice::retuneCard() {
+  if (_cardTimingMode != kSDATimingModeHS400) {
+    return tuneCard(_cardBusWidth);
+  }
+
+  //
+  // Tuning cannot be done in HS400, the card is returned to high speed and then switched through HS200 again.
+  // The host is lowered to high speed timing at 52 MHz first, so the switch is not sent at the timing the card is leaving.
+  //
+  if (!_cardSlot->setControllerClock(kSDAHighSpeedClock52MHz)
+      || !setMMCHostControl2(SDHCRegHostControl2UHSMode::set(_cardSlot->getHostControl2() | kSDHCRegHostControl21_8VSignaling,
+                                                             kSDHCRegHostControl2UHS_SDR12))) {
+    return false;
+  }
+  return setMMCSpeed(kMMCTimingSpeedHighSpeed)
+    && setMMCTimingMode(kSDATimingModeHS400, _cardBusWidth);
+}
+
+void EmeraldSDHCBlockStorageDevice::handleRetune() {
+  IOReturn status;
+  UInt64   startTime;
+  bool     isCardFailed = false;
+
+  //
+  // Card initialization or power management may have changed the card in the meantime.
+  //
+  IOLockLock(_cardStateLock);
+  status = _cmdGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &EmeraldSDHCBlockStorageDevice::waitForRetuneGated));
+
+  if (status == kIOReturnSuccess) {
+    startTime = mach_absolute_time();
+    if (!retuneCard()) {
+      //
+      // Host and card timing are unknown if re-tuning failed, and the card can no longer be used for I/O.
+      // The timing mode is renegotiated by card initialization on the card change thread, not while commands are held.
+      // The failed timing mode is not restored again.
+      //
+      EMSYSLOG("Failed to re-tune card, reinitializing card");
+      _isCardReady        = false;
+      _isCardFailed       = true;
+      _isTimingCacheValid = false;
+      _cardInitRetryCount = 0;
+      isCardFailed        = true;
+    }
+    EMDBGLOG("Re-tuning complete in %llu us", getElapsedTimeUs(startTime));
+  }
+
+  _cmdGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &EmeraldSDHCBlockStorageDevice::finishRetuneGated), &isCardFailed);
+  IOLockUnlock(_cardStateLock);
+
+  //
+  // Take the media offline and initialize the card again on the card change thread.
+  //
+  if (isCardFailed) {
+    messageClients(kIOMessageMediaStateHasChanged, reinterpret_cast<void*>(kIOMediaStateOffline), 0);
+    thread_call_enter(_cardChangeThread);
+  }
+}
+
+IOReturn EmeraldSDHCBlockStorageDevice::waitForRetuneGated() {
+  if (!_isCardReady || !isCardTuned() || !isRetuneDue()) {
+    return kIOReturnNotReady;
+  }
+
+  //
+  // Hold further commands, re-tuning starts once the current command completes.
+  //
+  _isRetuning = true;
+  while (_currentCommand != nullptr) {
+    _cmdGate->commandSleep(&_currentCommand);
+  }
+  return kIOReturnSuccess;
+}
+
+IOReturn EmeraldSDHCBlockStorageDevice::finishRetuneGated(bool *isCardFailed) {
+  _isRetuning        = false;
+  _isRetuneRequested = false;
+  _isRetuneNeeded    = false;
+  _retuneDeadline    = _retuneInterval != 0 ? mach_absolute_time() + _retuneInterval : 0;
+
+  //
+  // Fail held commands if the card can no longer be used, otherwise resume them.
+  //
+  if (*isCardFailed) {
+    flushCommandQueue(kIOReturnNotReady);
+  } else if (_currentCommand == nullptr) {
+    startNextCommand();
+  }
+  return kIOReturnSuccess;
+}
+
 bool EmeraldSDHCBlockStorageDevice::setMMCSpeed(MMCTimingSpeed speed) {
+  UInt64 startTime = mach_absolute_time();
+
   //
   // Change card mode.
   //
-  EMDBGLOG("Host controller slot capabilities: 0x%llX", _cardSlot->readReg64(kSDHCRegCapabilities));
+  EMDBGLOG("Host controller slot capabilities: 0x%llX", _cardSlot->getControllerCapabilities());
   EMDBGLOG("Setting MMC speed to 0x%X", speed);
   if (!switchMMCExtendedCSD (kMMCSwitchAccessWriteByte, __offsetof(MMCExtendedCSDRegister, hsTiming), (1 << kMMCHSTimingDriverStrengthShift) | speed)) { // TODO: Driver strength defaults to B in the host controller, setting that here for now.
     return false;
   }
+  _mmcExtendedCSD.hsTiming = (1 << kMMCHSTimingDriverStrengthShift) | speed;
 
   //
   // Set high speed bit only if in high speed mode.
   //
-  UInt16 hcControl1 = _cardSlot->readReg16(kSDHCRegHostControl1);
+  UInt8 hcControl1 = _cardSlot->getHostControl1();
   if (speed != kMMCTimingSpeedDefault) {
     hcControl1 |= kSDHCRegHostControl1HighSpeedEnable;
   } else {
     hcControl1 &= ~kSDHCRegHostControl1HighSpeedEnable;
   }
-  _cardSlot->writeReg16(kSDHCRegHostControl1, hcControl1);
+  _cardSlot->setHostControl1(hcControl1);
 
   //
   // Set host control 2 register for HS200 and HS400 modes.
+  // High speed keeps the current signaling voltage, as the HS400 sequence passes through high speed at 1.8V.
   //
-  UInt16 hcControl2 = _cardSlot->readReg16(kSDHCRegHostControl2);
-  hcControl2 &= ~(kSDHCRegHostControl21_8VSignaling | kSDHCRegHostControl2UHS_Mask);
+  UInt16 hcControl2 = SDHCRegHostControl2UHSMode::set(_cardSlot->getHostControl2(), kSDHCRegHostControl2UHS_SDR12);
   if (speed == kMMCTimingSpeedHS200) {
-    hcControl2 |= kSDHCRegHostControl21_8VSignaling | kSDHCRegHostControl2UHS_SDR104;
+    hcControl2 = SDHCRegHostControl2UHSMode::set(hcControl2 | kSDHCRegHostControl21_8VSignaling, kSDHCRegHostControl2UHS_SDR104);
   } else if (speed == kMMCTimingSpeedHS400) {
-    hcControl2 |= kSDHCRegHostControl21_8VSignaling | kSDHCRegHostControl2UHS_HS400;
-    // TODO: Support HS400 on the host controller side.
-  } else {
-   // hcControl2 &= ~(kSDHCRegHostControl21_8VSignaling | kSDHCRegHostControl2UHS_Mask);
+    hcControl2 = SDHCRegHostControl2UHSMode::set(hcControl2 | kSDHCRegHostControl21_8VSignaling, kSDHCRegHostControl2UHS_HS400);
+  } else if (speed == kMMCTimingSpeedDefault) {
+    hcControl2 &= ~kSDHCRegHostControl21_8VSignaling;
+  }
+  if (!setMMCHostControl2(hcControl2)) {
+    return false;
   }
-  _cardSlot->writeReg16(kSDHCRegHostControl2, hcControl2);
-  IOSleep(50);
-  EMDBGLOG("HC set to 1:0x%X 2:0x%X", _cardSlot->readReg16(kSDHCRegHostControl1), _cardSlot->readReg16(kSDHCRegHostControl2));
+  EMDBGLOG("HC set to 1:0x%X 2:0x%X, speed changed in %llu us", _cardSlot->getHostControl1(), _cardSlot->getHostControl2(), getElapsedTimeUs(startTime));
+
+  return true;
+}
 
+bool EmeraldSDHCBlockStorageDevice::setMMCHostControl2(UInt16 hcControl2) {
+  UInt16 modeMask         = kSDHCRegHostControl21_8VSignaling | SDHCRegHostControl2UHSMode::mask;
+  bool   wasSignaling1_8V = _cardSlot->getHostControl2() & kSDHCRegHostControl21_8VSignaling;
+
+  //
+  // The controller selects the preset from the signaling and UHS mode, changing either with presets enabled would switch SDCLK.
+  // Stop the clock instead, the caller sets the clock for the new mode afterwards.
+  // Preset value enable is only changed by the slot when setting the clock.
+  //
+  if ((_cardSlot->getHostControl2() & kSDHCRegHostControl2PresetValueEnable)
+      && ((_cardSlot->getHostControl2() ^ hcControl2) & modeMask) != 0) {
+    _cardSlot->setControllerClock(0);
+  }
+  hcControl2 &= ~kSDHCRegHostControl2PresetValueEnable;
+  hcControl2 |= _cardSlot->getHostControl2() & kSDHCRegHostControl2PresetValueEnable;
+  _cardSlot->setHostControl2(hcControl2);
+
+  //
+  // Signal voltage regulator needs to settle if 1.8V signaling was just enabled.
+  //
+  if ((hcControl2 & kSDHCRegHostControl21_8VSignaling) && !wasSignaling1_8V) {
+    IOSleep(kSDA1_8VSignalingSettleTimeMs);
+    if ((_cardSlot->readReg<SDHCRegHostControl2>() & kSDHCRegHostControl21_8VSignaling) == 0) {
+      EMSYSLOG("Host controller failed to switch to 1.8V signaling");
+      return false;
+    }
+  }
   return true;
 }
 
 bool EmeraldSDHCBlockStorageDevice::initCard() {
   IOReturn status;
+  UInt64   startTime = mach_absolute_time();
   
   //
   // Check if card is present.
@@ -658,9 +1476,25 @@ bool EmeraldSDHCBlockStorageDevice::initCard() {
   if (!_cardSlot->isCardPresent()) {
     EMDBGLOG("No card is currently inserted");
     _isCardInserted = false;
+    _isCardReady    = false;
+    _isCardFailed   = false;
     return false;
   }
+
+  //
+  // Card stays inserted if initialization fails, and is marked as failed until initialized.
+  //
   _isCardInserted = true;
+  _isCardReady    = false;
+  _isCardFailed   = true;
+
+  //
+  // Card is untuned until the timing mode is negotiated again.
+  //
+  _cardTimingMode     = kSDATimingModeLegacy;
+  _cardBusWidth       = kSDABusWidth1;
+  _cardEnhancedStrobe = false;
+  startRetuneTimer();
 
   //
   // Reset to initialization clock and power on the card.
@@ -677,7 +1511,6 @@ bool EmeraldSDHCBlockStorageDevice::initCard() {
     EMSYSLOG("Failed to initialize card");
     _cardSlot->setControllerPower(false);
     _cardSlot->setControllerClock(0);
-    _isCardInserted = false;
     return false;
   }
 
@@ -707,11 +1540,194 @@ bool EmeraldSDHCBlockStorageDevice::initCard() {
   if (isSDCard()) {
     
   } else {
-    if (isExtendedCSDSupported()) {
-      switchMMCSpeed();
+    //
+    // Card and host timing may not match if the card could not be returned to legacy timing.
+    // The card is powered off so the next card event starts again from the initialization clock.
+    //
+    if (isExtendedCSDSupported() && !switchMMCSpeed()) {
+      EMSYSLOG("Failed to switch card speed");
+      _cardSlot->setControllerPower(false);
+      _cardSlot->setControllerClock(0);
+      _isTimingCacheValid = false;
+      return false;
+    }
+  }
+
+  EMDBGLOG("DAT signal %X", _cardSlot->readReg<SDHCRegPresentState>());
+  //
+  // Publish initialization time, and the time saved over a full initialization if the identity was reused.
+  //
+  UInt64 initTimeUs = getElapsedTimeUs(startTime);
+  EMDBGLOG("Card initialized in %llu us", initTimeUs);
+  setProperty(kSDACardInitTimeKey, initTimeUs, 64);
+  if (!_isCardIdentityReused) {
+    _cardFullInitTimeUs = initTimeUs;
+  }
+  setProperty(kSDACardInitTimeSavedKey, _isCardIdentityReused && _cardFullInitTimeUs > initTimeUs ? _cardFullInitTimeUs - initTimeUs : 0, 64);
+  _cardSlot->publishWaitStatistics();
+  _isCardReady  = true;
+  _isCardFailed = false;
+  return true;
+}
+
+UInt32 EmeraldSDHCBlockStorageDevice::getMMCSleepAwakeTimeout() {
+  //
+  // Sleep/awake timeout is 100 ns * 2^N, round up to the nearest millisecond.
+  //
+  UInt8 timeoutValue = _mmcExtendedCSD.sleepAwakeTimeout;
+  if (timeoutValue > kMMCSleepAwakeTimeoutMax) {
+    timeoutValue = kMMCSleepAwakeTimeoutMax;
+  }
+  UInt32 timeoutMs = (UInt32) (((100ULL << timeoutValue) + 999999) / 1000000);
+  return timeoutMs > kSDATimeout_2sec ? timeoutMs : kSDATimeout_2sec;
+}
+
+bool EmeraldSDHCBlockStorageDevice::sleepCard() {
+  UInt64 startTime = mach_absolute_time();
+
+  //
+  // Only fully initialized embedded MMC cards keep power during sleep.
+  // Card state lock is held, so card initialization cannot be in progress.
+  //
+  if (!_isCardReady || !_isCardEmbedded || isSDCard()) {
+    return false;
+  }
+
+  //
+  // Card is deselected into standby state before CMD5, the card then holds busy until asleep.
+  //
+  IOReturn status = doSyncCommand(kMMCCommandSleepAwake, (_cardAddress << kSDARelativeAddressShift) | kMMCSleepAwakeSleep,
+                                  getMMCSleepAwakeTimeout());
+  if (status != kIOReturnSuccess || !_cardSlot->waitForCardIdle(getMMCSleepAwakeTimeout() * 1000)) {
+    EMSYSLOG("Failed to put card to sleep with status 0x%X", status);
+    return false;
+  }
+
+  //
+  // Card cannot be used until woken.
+  //
+  _isCardReady = false;
+  EMDBGLOG("Card is asleep, entered sleep in %llu us", getElapsedTimeUs(startTime));
+  return true;
+}
+
+bool EmeraldSDHCBlockStorageDevice::restoreHostTimingMode() {
+  UInt16 uhsMode;
+  UInt32 clockSpeed;
+
+  //
+  // Card keeps its timing mode and bus width while asleep, the host controller must be returned to the same configuration.
+  //
+  _cardSlot->setControllerBusWidth(_cardBusWidth);
+  if (_cardTimingMode != kSDATimingModeLegacy) {
+    _cardSlot->setHostControl1(_cardSlot->getHostControl1() | kSDHCRegHostControl1HighSpeedEnable);
+  }
+
+  uhsMode = kSDHCRegHostControl2UHS_SDR12;
+  switch (_cardTimingMode) {
+    case kSDATimingModeHS400:
+      //
+      // Without enhanced strobe the tuning needed by HS400 was lost, the host starts in high speed at 52 MHz
+      //   and the card is switched through HS200 again by the re-tune below, as for a fresh switch.
+      //
+      if (_cardEnhancedStrobe) {
+        uhsMode    = kSDHCRegHostControl2UHS_HS400;
+        clockSpeed = kSDAHS200Clock200MHz;
+      } else {
+        clockSpeed = kSDAHighSpeedClock52MHz;
+      }
+      break;
+
+    case kSDATimingModeHS200:
+      uhsMode    = kSDHCRegHostControl2UHS_SDR104;
+      clockSpeed = kSDAHS200Clock200MHz;
+      break;
+
+    case kSDATimingModeDDR52:
+      uhsMode    = kSDHCRegHostControl2UHS_DDR50;
+      clockSpeed = kSDAHighSpeedClock52MHz;
+      break;
+
+    case kSDATimingModeHighSpeed:
+      clockSpeed = (_mmcExtendedCSD.deviceType & kMMCDeviceTypeHighSpeed_52MHz) ? kSDAHighSpeedClock52MHz : kSDANormalSpeedClock26MHz;
+      break;
+
+    default:
+      clockSpeed = _mmcMaxStandardClock;
+      break;
+  }
+  if (!setMMCHostControl2(SDHCRegHostControl2UHSMode::set(_cardSlot->getHostControl2(), uhsMode))
+      || !_cardSlot->setControllerClock(clockSpeed)) {
+    return false;
+  }
+  _cardSlot->setControllerEnhancedStrobe(_cardEnhancedStrobe);
+
+  //
+  // Tuning is lost with the host controller reset.
+  //
+  if (isCardTuned() && !retuneCard()) {
+    return false;
+  }
+  _cardSlot->setControllerDMAMode(_hcTransferType);
+  return true;
+}
+
+bool EmeraldSDHCBlockStorageDevice::awakeCard() {
+  IOReturn status;
+  UInt64   startTime = mach_absolute_time();
+
+  if (!_cardSlot->isCardPresent()) {
+    return false;
+  }
+
+  //
+  // Card power must have been kept on while asleep, a card that lost power can only be fully initialized.
+  //
+  if ((_cardSlot->readReg<SDHCRegPowerControl>() & kSDHCRegPowerControlVDD1On) == 0) {
+    EMSYSLOG("Card lost power while asleep, reinitializing");
+    return false;
+  }
+
+  //
+  // Run the card at the standard clock and 1-bit bus, CMD5 only uses the command line.
+  // 1.8V signaling must be restored first if the card was using it.
+  //
+  if (!_cardSlot->setControllerClock(_mmcMaxStandardClock)) {
+    return false;
+  }
+  _cardSlot->setControllerBusWidth(kSDABusWidth1);
+  if (_cardTimingMode == kSDATimingModeHS200 || _cardTimingMode == kSDATimingModeHS400 || _cardTimingMode == kSDATimingModeDDR52) {
+    if (!setMMCHostControl2(_cardSlot->getHostControl2() | kSDHCRegHostControl21_8VSignaling)) {
+      return false;
     }
   }
 
-  EMDBGLOG("DAT signal %X", _cardSlot->readReg32(kSDHCRegPresentState));
+  //
+  // Wake card back into standby state.
+  //
+  status = doSyncCommand(kMMCCommandSleepAwake, _cardAddress << kSDARelativeAddressShift, getMMCSleepAwakeTimeout());
+  if (status != kIOReturnSuccess || !_cardSlot->waitForCardIdle(getMMCSleepAwakeTimeout() * 1000)) {
+    EMSYSLOG("Failed to wake card with status 0x%X, reinitializing", status);
+    return false;
+  }
+
+  //
+  // Restore host controller configuration and block length, then verify the card with a read of the extended CSD.
+  //
+  if (!restoreHostTimingMode()) {
+    EMSYSLOG("Failed to restore timing mode %s, reinitializing", getTimingModeString(_cardTimingMode));
+    return false;
+  }
+  status = doSyncCommand(kMMCCommandSetBlockLength, kSDABlockSize, kSDATimeout_10sec);
+  if (status != kIOReturnSuccess || !verifyMMCTimingMode(_cardTimingMode)) {
+    EMSYSLOG("Failed to verify card after wake with status 0x%X, reinitializing", status);
+    return false;
+  }
+
+  startRetuneTimer();
+  _isCardInserted = true;
+  _isCardReady    = true;
+  EMDBGLOG("Card woken in %llu us", getElapsedTimeUs(startTime));
+  _cardSlot->publishWaitStatistics();
   return true;
 }
@@ -27,13 +27,13 @@ static const SDACommandTableEntry MMCCommandTable[] = {
   { kMMCCommandReadDatUntilStop,    kSDAResponseTypeR1,   kSDADataDirectionCardToHost,  kSDACommandFlagsNeedsSelection },
   { kMMCCommandStopTransmission,    kSDAResponseTypeR1,   kSDADataDirectionNone },
   { kMMCCommandSendStatus,          kSDAResponseTypeR1,   kSDADataDirectionNone },
-  { kMMCCommandInvalid,             kSDAResponseTypeR0,   kSDADataDirectionNone,        kSDACommandFlagsNeedsSelection },
+  { kMMCCommandBusTestRead,         kSDAResponseTypeR1d,  kSDADataDirectionCardToHost,  kSDACommandFlagsNeedsSelection },
   { kMMCCommandGoInactiveState,     kSDAResponseTypeR0,   kSDADataDirectionNone },
   { kMMCCommandSetBlockLength,      kSDAResponseTypeR1,   kSDADataDirectionNone,        kSDACommandFlagsNeedsSelection },
   { kMMCCommandReadSingleBlock,     kSDAResponseTypeR1d,  kSDADataDirectionCardToHost,  kSDACommandFlagsNeedsSelection },
   { kMMCCommandReadMultipleBlock,   kSDAResponseTypeR1d,  kSDADataDirectionCardToHost,  kSDACommandFlagsNeedsSelection,
                                     kSDHCRegTransferModeMultipleBlock | kSDHCRegTransferModeAutoCMD12 },
-  { kMMCCommandInvalid,             kSDAResponseTypeR0,   kSDADataDirectionNone },
+  { kMMCCommandBusTestWrite,        kSDAResponseTypeR1d,  kSDADataDirectionHostToCard,  kSDACommandFlagsNeedsSelection },
 
   // 20 - 29
   { kMMCCommandWriteDatUntilStop,   kSDAResponseTypeR1,   kSDADataDirectionHostToCard,  kSDACommandFlagsNeedsSelection },
@@ -220,16 +220,40 @@ EmeraldSDHCCommand* EmeraldSDHCBlockStorageDevice::getNextCommandQueue() {
   EmeraldSDHCCommand *command = nullptr;
 
   if (!queue_empty(&_cmdQueue)) {
+    //
+    // Only commands issued by re-tuning can run while re-tuning.
+    //
+    if (_isRetuning && !((EmeraldSDHCCommand*) queue_first(&_cmdQueue))->isRetuneCommand) {
+      return nullptr;
+    }
     queue_remove_first(&_cmdQueue, command, EmeraldSDHCCommand*, queueChain);
   }
 
   return command;
 }
 
-void EmeraldSDHCBlockStorageDevice::flushCommandQueue() {
+void EmeraldSDHCBlockStorageDevice::startNextCommand() {
+  _currentCommand = getNextCommandQueue();
+  if (_currentCommand != nullptr) {
+    _timerEventSourceTimeouts->setTimeoutMS(_currentCommand->getTimeoutMS());
+    doAsyncIO();
+  } else if (_isRetuning) {
+    //
+    // Bus is now idle and re-tuning can start.
+    //
+    _cmdGate->commandWakeup(&_currentCommand);
+  }
+}
+
+void EmeraldSDHCBlockStorageDevice::flushCommandQueue(IOReturn status) {
   EmeraldSDHCCommand *command;
+
+  //
+  // Complete all queued commands with the specified status, none of these have been started.
+  //
   while (!queue_empty(&_cmdQueue)) {
     queue_remove_first(&_cmdQueue, command, EmeraldSDHCCommand*, queueChain);
+    IOStorage::complete(&command->completion, status, 0);
     command->state = kEmeraldSDHCStateDone;
     _cmdPool->returnCommand(command);
   }
@@ -252,8 +276,11 @@ IOReturn EmeraldSDHCBlockStorageDevice::doSyncCommandWithData(UInt32 command, UI
   _isSleepingSyncCommand = true;
   _syncCommandResult = kIOReturnTimeout;
 
+  //
+  // Callers hold the card state lock, while re-tuning only the re-tuning thread can issue sync commands.
+  //
   status = doAsyncCommandWithData(command, argument, timeout, &syncCompletion,
-                                  blockCount, blockCount, blockSize, memoryDescriptor, memoryDescriptorOffset, response);
+                                  blockCount, blockCount, blockSize, memoryDescriptor, memoryDescriptorOffset, response, _isRetuning);
   if (status != kIOReturnSuccess) {
     return status;
   }
@@ -283,7 +310,7 @@ void EmeraldSDHCBlockStorageDevice::handleSyncCommandCompletion(void *parameter,
 IOReturn EmeraldSDHCBlockStorageDevice::doAsyncCommandWithData(UInt32 command, UInt32 argument, UInt32 timeout, IOStorageCompletion *completion,
                                                                UInt32 blockCount, UInt32 blockCountTotal, UInt32 blockSize,
                                                                IOMemoryDescriptor *memoryDescriptor, IOByteCount memoryDescriptorOffset,
-                                                               SDACommandResponse *response) {
+                                                               SDACommandResponse *response, bool isRetuneCommand) {
   EmeraldSDHCAsyncCommandArgs cmdArgs = { };
 
   cmdArgs.command                = command;
@@ -296,6 +323,7 @@ IOReturn EmeraldSDHCBlockStorageDevice::doAsyncCommandWithData(UInt32 command, U
   cmdArgs.blockSize              = blockSize;
   cmdArgs.memoryDescriptor       = memoryDescriptor;
   cmdArgs.memoryDescriptorOffset = memoryDescriptorOffset;
+  cmdArgs.isRetuneCommand        = isRetuneCommand;
 
   return _cmdGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this,
                                                   &EmeraldSDHCBlockStorageDevice::doAsyncCommandGated),
@@ -345,20 +373,28 @@ IOReturn EmeraldSDHCBlockStorageDevice::doAsyncCommandGated(EmeraldSDHCAsyncComm
   command->blockCountTotal = args->blockCountTotal;
   command->blockSize = args->blockSize;
   command->cmdResponse = args->response;
+  command->isRetuneCommand = args->isRetuneCommand;
+  command->setTimeoutMS(args->timeout);
   command->state = kEmeraldSDHCStateStart;
 
-  addCommandToQueue(command);
+  //
+  // Commands issued by re-tuning run ahead of any held commands.
+  // Re-tuning is requested once due, and held commands resume afterwards.
+  //
+  if (command->isRetuneCommand) {
+    queue_enter_first(&_cmdQueue, command, EmeraldSDHCCommand*, queueChain);
+  } else {
+    addCommandToQueue(command);
+    if (isRetuneDue()) {
+      requestRetune();
+    }
+  }
   EMIODBGLOG("Added command 0x%X to queue", args->command);
   
   if (_currentCommand == nullptr) {
-    
-    _currentCommand = getNextCommandQueue();
-    _timerEventSourceTimeouts->setTimeoutMS(args->timeout);
-    
-    doAsyncIO();
+    startNextCommand();
   }
 
-  
   return kIOReturnSuccess;
 }
 
@@ -368,6 +404,19 @@ void EmeraldSDHCBlockStorageDevice::doAsyncIO(UInt16 interruptStatus) {
     return;
   }
 
+  //
+  // Commands on the bus without data only advance on command or transfer completion.
+  // Data transfers check their own interrupt bits.
+  //
+  if ((_currentCommand->state == kEmeraldSDHCStateCardSelectionSent
+       || _currentCommand->state == kEmeraldSDHCStateAppCommandSent
+       || _currentCommand->state == kEmeraldSDHCStateCommandSent
+       || (_currentCommand->state == kEmeraldSDHCStateDataTransfer && _currentCommand->memoryDescriptor == nullptr))
+      && (interruptStatus & (kSDHCRegNormalIntStatusCommandComplete | kSDHCRegNormalIntStatusTransferComplete)) == 0) {
+    EMIODBGLOG("Ignoring interrupt bits 0x%X in command state %u", interruptStatus, _currentCommand->state);
+    return;
+  }
+
   //
   // Process current command state in state machine.
   //
@@ -455,10 +504,10 @@ void EmeraldSDHCBlockStorageDevice::doAsyncIO(UInt16 interruptStatus) {
       //
       // Get response data.
       //
-      EMIODBGLOG("Command response 0x%08X%08X", _cardSlot->readReg64(kSDHCRegResponse1), _cardSlot->readReg64(kSDHCRegResponse0));
       if (_currentCommand->cmdResponse != nullptr) {
-        _currentCommand->cmdResponse->bytes8[0] = _cardSlot->readReg64(kSDHCRegResponse0);
-        _currentCommand->cmdResponse->bytes8[1] = _cardSlot->readReg64(kSDHCRegResponse1);
+        _currentCommand->cmdResponse->bytes8[0] = _cardSlot->readReg<SDHCRegResponse0>();
+        _currentCommand->cmdResponse->bytes8[1] = _cardSlot->readReg<SDHCRegResponse1>();
+        EMIODBGLOG("Command response 0x%016llX%016llX", _currentCommand->cmdResponse->bytes8[1], _currentCommand->cmdResponse->bytes8[0]);
       }
 
       _currentCommand->result = kIOReturnSuccess;
@@ -479,11 +528,7 @@ void EmeraldSDHCBlockStorageDevice::doAsyncIO(UInt16 interruptStatus) {
       _currentCommand->state = kEmeraldSDHCStateDone;
       _cmdPool->returnCommand(_currentCommand);
 
-      _currentCommand = getNextCommandQueue();
-      if (_currentCommand != nullptr) {
-        doAsyncIO();
-      }
-
+      startNextCommand();
       break;
 
     default:
@@ -546,7 +591,7 @@ IOReturn EmeraldSDHCBlockStorageDevice::prepareAsyncDataTransfer(EmeraldSDHCComm
         }
       }
 
-      _cardSlot->writeReg32(kSDHCRegADMASysAddress, descAddr);
+      _cardSlot->writeReg<SDHCRegADMASysAddress>(descAddr);
       EMIODBGLOG("Using ADMA physical address %p", descAddr);
 
     //
@@ -559,7 +604,7 @@ IOReturn EmeraldSDHCBlockStorageDevice::prepareAsyncDataTransfer(EmeraldSDHCComm
         return status;
       }
 
-      _cardSlot->writeReg32(kSDHCRegSDMA, segment.fIOVMAddr);
+      _cardSlot->writeReg<SDHCRegSDMA>(segment.fIOVMAddr);
       EMIODBGLOG("Using SDMA physical address %p for first segment", segment.fIOVMAddr);
     }
   }
@@ -567,8 +612,8 @@ IOReturn EmeraldSDHCBlockStorageDevice::prepareAsyncDataTransfer(EmeraldSDHCComm
   //
   // Set block size and block count.
   //
-  _cardSlot->writeReg16(kSDHCRegBlockSize, command->blockSize);
-  _cardSlot->writeReg16(kSDHCRegBlockCount, command->blockCount);
+  _cardSlot->writeReg<SDHCRegBlockSize>(command->blockSize);
+  _cardSlot->writeReg<SDHCRegBlockCount>(command->blockCount);
 
   //
   // Set transfer mode.
@@ -589,7 +634,7 @@ IOReturn EmeraldSDHCBlockStorageDevice::prepareAsyncDataTransfer(EmeraldSDHCComm
   // Add any command-specific transfer mode flags.
   //
   transferMode |= command->cmdEntry->hostFlags;
-  _cardSlot->writeReg16(kSDHCRegTransferMode, transferMode);
+  _cardSlot->writeReg<SDHCRegTransferMode>(transferMode);
 
   EMIODBGLOG("Preparing to transfer %u blocks total (%u bytes) using %s and transfer mode 0x%X",
              command->blockCount, command->blockCount * command->blockSize,
@@ -634,11 +679,11 @@ IOReturn EmeraldSDHCBlockStorageDevice::executeAsyncDataTransfer(EmeraldSDHCComm
     //
     for (int i = 0; i < (command->blockSize / sizeof (data32)); i++) {
       if (command->cmdEntry->dataDirection == kSDADataDirectionCardToHost) {
-        data32 = _cardSlot->readReg32(kSDHCRegBufferDataPort);
+        data32 = _cardSlot->readReg<SDHCRegBufferDataPort>();
         command->memoryDescriptor->writeBytes(command->memoryDescriptorOffset + command->currentDataOffset, &data32, sizeof (data32));
       } else {
         command->memoryDescriptor->readBytes(command->memoryDescriptorOffset + command->currentDataOffset, &data32, sizeof (data32));
-        _cardSlot->writeReg32(kSDHCRegBufferDataPort, data32);
+        _cardSlot->writeReg<SDHCRegBufferDataPort>(data32);
       }
       command->currentDataOffset += sizeof (data32);
     }
@@ -654,7 +699,7 @@ IOReturn EmeraldSDHCBlockStorageDevice::executeAsyncDataTransfer(EmeraldSDHCComm
       EMDBGLOG("Failed to generate SDMA segment with status 0x%X", status);
       return status;
     }
-    _cardSlot->writeReg32(kSDHCRegSDMA, segment.fIOVMAddr);
+    _cardSlot->writeReg<SDHCRegSDMA>(segment.fIOVMAddr);
     EMIODBGLOG("Processed next SDMA block, current data offset 0x%X", command->currentDataOffset);
   }
 
@@ -683,13 +728,13 @@ bool EmeraldSDHCBlockStorageDevice::sendAsyncCommand(const SDACommandTableEntry
   
   int ddd =0;
   if (cmdIndex != kSDCommandGoIdleState) {
-    while (_cardSlot->readReg32(kSDHCRegPresentState) & (kSDHCRegPresentStateCardCmdInhibit | kSDHCRegPresentStateCardDatInhibit)) {
+    while (_cardSlot->readReg<SDHCRegPresentState>() & (kSDHCRegPresentStateCardCmdInhibit | kSDHCRegPresentStateCardDatInhibit)) {
       IODelay(1);
       ddd++;
 
       if (ddd > 5000000) {
-       // panic("Timeout waiting for CMD inhibit! state %X int %X err %X", _cardSlot->readReg32(kSDHCRegPresentState), _cardSlot->readReg16(kSDHCRegNormalIntStatus), _cardSlot->readReg16(kSDHCRegErrorIntStatus));
-        EMDBGLOG("Timeout waiting for CMD inhibit! state %X int %X err %X adma err %x", _cardSlot->readReg32(kSDHCRegPresentState), _cardSlot->readReg16(kSDHCRegNormalIntStatus), _cardSlot->readReg16(kSDHCRegErrorIntStatus), _cardSlot->readReg16(kSDHCRegADMAErrorStatus));
+       // panic("Timeout waiting for CMD inhibit! state %X int %X err %X", _cardSlot->readReg<SDHCRegPresentState>(), _cardSlot->readReg<SDHCRegNormalIntStatus>(), _cardSlot->readReg<SDHCRegErrorIntStatus>());
+        EMDBGLOG("Timeout waiting for CMD inhibit! state %X int %X err %X adma err %x", _cardSlot->readReg<SDHCRegPresentState>(), _cardSlot->readReg<SDHCRegNormalIntStatus>(), _cardSlot->readReg<SDHCRegErrorIntStatus>(), _cardSlot->readReg<SDHCRegADMAErrorStatus>());
         //return true;
         while (true);
       }
@@ -697,10 +742,9 @@ bool EmeraldSDHCBlockStorageDevice::sendAsyncCommand(const SDACommandTableEntry
   }
 
   //
-  // Reset bits.
+  // Reset bits, including any already collected by the interrupt filter.
   //
-  _cardSlot->writeReg16(kSDHCRegErrorIntStatus, -1);
-  _cardSlot->writeReg16(kSDHCRegNormalIntStatus, -1);
+  _cardSlot->clearCommandInterrupts();
 
   //
   // If this is a selection command, and cards are being deselected, there will be no response.
@@ -712,8 +756,8 @@ bool EmeraldSDHCBlockStorageDevice::sendAsyncCommand(const SDACommandTableEntry
   //
   // Send command and argument.
   //
-  _cardSlot->writeReg32(kSDHCRegArgument, arg);
-  _cardSlot->writeReg16(kSDHCRegCommand, (cmdIndex << 8) | cmdResponse);
+  _cardSlot->writeReg<SDHCRegArgument>(arg);
+  _cardSlot->writeReg<SDHCRegCommand>((cmdIndex << 8) | cmdResponse);
   EMIODBGLOG("Sent %s command %u with arg 0x%X (response bits 0x%X)", isSDCard() ? "SD" : "MMC", cmdIndex, arg, cmdResponse);
   //return true;// !((cmdResponse == kSDAResponseTypeR0) || (cmdEntry->flags & kSDACommandFlagsIgnoreCmdComplete));
   return (cmdEntry->flags & kSDACommandFlagsIgnoreCmdComplete) == 0;
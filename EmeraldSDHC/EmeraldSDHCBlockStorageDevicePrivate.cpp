@@ -13,11 +13,27 @@
 #include <IOKit/scsi/IOSCSIProtocolInterface.h>
 #include <IOKit/storage/IOBlockStorageDriver.h>
 
-void EmeraldSDHCBlockStorageDevice::handleInterrupt() {
-  UInt16 intStatus = _cardSlot->readReg16(kSDHCRegNormalIntStatus);
+void EmeraldSDHCBlockStorageDevice::handleInterrupt(UInt16 intStatus, UInt16 errorIntStatus) {
+  //
+  // Process interrupts until no enabled causes are pending.
+  // Causes raised during processing (such as command completion after transfer completion)
+  //   are handled here without waiting for another interrupt.
+  //
+  // Any causes still pending after the last pass are left to raise a new interrupt.
+  //
+  for (int pass = 1; ; pass++) {
+    processInterrupt(intStatus, errorIntStatus);
+    if (pass >= kSDAInterruptMaxPasses || !_cardSlot->getPendingInterrupts(&intStatus, &errorIntStatus)) {
+      break;
+    }
+  }
+}
 
-  EMIODBGLOG("Interrupt (slot bits 0x%X)! 0x%X", _cardSlot->readReg16(kSDHCRegHostControllerSlotIntStatus), intStatus);
-  _cardSlot->writeReg16(kSDHCRegNormalIntStatus, intStatus);
+void EmeraldSDHCBlockStorageDevice::processInterrupt(UInt16 intStatus, UInt16 errorIntStatus) {
+  //
+  // Interrupt status has already been acknowledged by the card slot.
+  //
+  EMIODBGLOG("Interrupt! 0x%X (error bits 0x%X)", intStatus, errorIntStatus);
 
   //
   // Cancel I/O operations for card removal.
@@ -27,7 +43,43 @@ void EmeraldSDHCBlockStorageDevice::handleInterrupt() {
       _currentCommand->result = kIOReturnAborted;
       _currentCommand->state  = kEmeraldSDHCStateComplete;
     }
-    flushCommandQueue();
+    flushCommandQueue(kIOReturnAborted);
+  }
+
+  //
+  // Fail the current command on any error.
+  // Command and data lines must be reset before another command can be sent.
+  // No response from the card is reported as a timeout, as card identification relies on this.
+  //
+  // MMC bus test data has no meaningful CRC, and BUS_TEST_W has no CRC status token.
+  // Data errors on these commands complete the command normally, the caller checks the returned pattern.
+  //
+  if ((intStatus & kSDHCRegNormalIntStatusErrorInterrupt) && _currentCommand != nullptr
+      && _currentCommand->state != kEmeraldSDHCStateComplete) {
+    EMDBGLOG("Command 0x%X failed with error bits 0x%X", _currentCommand->cmdEntry->command, errorIntStatus);
+    _cardSlot->resetController(kSDHCRegSoftwareResetCmd);
+    _cardSlot->resetController(kSDHCRegSoftwareResetDat);
+    if (!isSDCard()
+        && (_currentCommand->cmdEntry->command == kMMCCommandBusTestWrite || _currentCommand->cmdEntry->command == kMMCCommandBusTestRead)) {
+      errorIntStatus &= ~(kSDHCRegErrorIntStatusDataTimeout | kSDHCRegErrorIntStatusDataCRC | kSDHCRegErrorIntStatusDataEndBit);
+    }
+    if (errorIntStatus == 0) {
+      _currentCommand->result = kIOReturnSuccess;
+    } else {
+      _currentCommand->result = (errorIntStatus & (kSDHCRegErrorIntStatusCommandTimeout | kSDHCRegErrorIntStatusDataTimeout))
+        ? kIOReturnTimeout : kIOReturnIOError;
+    }
+    _currentCommand->state  = kEmeraldSDHCStateComplete;
+  }
+
+  //
+  // Re-tune on re-tuning events, or on CRC errors as sampling may have drifted.
+  // Re-tuning starts once the failed command has completed.
+  //
+  if ((intStatus & kSDHCRegNormalIntStatusRetuningEvent)
+      || (errorIntStatus & (kSDHCRegErrorIntStatusCommandCRC | kSDHCRegErrorIntStatusDataCRC | kSDHCRegErrorIntStatusTuningError))) {
+    _isRetuneNeeded = true;
+    requestRetune();
   }
 
   //
@@ -45,7 +97,7 @@ void EmeraldSDHCBlockStorageDevice::handleInterrupt() {
 }
 
 void EmeraldSDHCBlockStorageDevice::handleIOTimeout(IOTimerEventSource *sender) {
-  EMDBGLOG("Timeout! error bits 0x%X", _cardSlot->readReg16(kSDHCRegErrorIntStatus));
+  EMDBGLOG("Timeout! error bits 0x%X", _cardSlot->readReg<SDHCRegErrorIntStatus>());
   _cardSlot->resetController(kSDHCRegSoftwareResetCmd);
   _cardSlot->resetController(kSDHCRegSoftwareResetDat);
   _currentCommand->result = kIOReturnTimeout;
@@ -53,13 +105,16 @@ void EmeraldSDHCBlockStorageDevice::handleIOTimeout(IOTimerEventSource *sender)
   doAsyncIO();
 }
 
-bool EmeraldSDHCBlockStorageDevice::initController() {
-  EMDBGLOG("Initializing SD host controller version %s", _cardSlot->getControllerVersionString());
+bool EmeraldSDHCBlockStorageDevice::initController(bool softReset) {
+  UInt16 normalIntSignals;
+
+  EMDBGLOG("Initializing SD host controller version %s (%s reset)", _cardSlot->getControllerVersionString(), softReset ? "soft" : "full");
 
   //
   // Completely reset controller.
+  // A soft reset only resets the command and data lines, keeping power and clock to a sleeping card.
   //
-  if (!_cardSlot->resetController(kSDHCRegSoftwareResetAll)) {
+  if (!_cardSlot->resetController(softReset ? (kSDHCRegSoftwareResetCmd | kSDHCRegSoftwareResetDat) : kSDHCRegSoftwareResetAll)) {
     EMSYSLOG("Failed to reset controller");
     return false;
   }
@@ -69,11 +124,24 @@ bool EmeraldSDHCBlockStorageDevice::initController() {
   //
   _isCardSelected = false;
 
-  _cardSlot->writeReg8(kSDHCRegTimeoutControl, 0xE);
-  _cardSlot->writeReg16(kSDHCRegNormalIntStatusEnable, -1);
-  _cardSlot->writeReg16(kSDHCRegErrorIntStatusEnable, -1);
-  _cardSlot->writeReg16(kSDHCRegNormalIntSignalEnable, kSDHCRegNormalIntStatusCommandComplete | kSDHCRegNormalIntStatusTransferComplete
-                        | kSDHCRegNormalIntStatusDMAInterrupt | kSDHCRegNormalIntStatusBufferWriteReady | kSDHCRegNormalIntStatusBufferReadReady);
+  _cardSlot->writeReg<SDHCRegTimeoutControl>(0xE);
+  _cardSlot->writeReg<SDHCRegNormalIntStatusEnable>(-1);
+  _cardSlot->writeReg<SDHCRegErrorIntStatusEnable>(-1);
+
+  //
+  // Re-tuning events are only defined for re-tuning mode 3.
+  //
+  normalIntSignals = kSDHCRegNormalIntStatusCommandComplete | kSDHCRegNormalIntStatusTransferComplete
+    | kSDHCRegNormalIntStatusDMAInterrupt | kSDHCRegNormalIntStatusBufferWriteReady | kSDHCRegNormalIntStatusBufferReadReady;
+  if (_cardSlot->getControllerVersion() >= kSDHostControllerVersion3_00
+      && SDHCRegCapabilitiesRetuningMode::get(_cardSlot->getControllerCapabilities()) == kSDHCRegCapabilitiesRetuningMode3) {
+    normalIntSignals |= kSDHCRegNormalIntStatusRetuningEvent;
+  }
+  _cardSlot->setNormalIntSignalEnable(normalIntSignals);
+  _cardSlot->setErrorIntSignalEnable(kSDHCRegErrorIntStatusCommandTimeout | kSDHCRegErrorIntStatusCommandCRC | kSDHCRegErrorIntStatusCommandEndBit
+                        | kSDHCRegErrorIntStatusCommandIndex | kSDHCRegErrorIntStatusDataTimeout | kSDHCRegErrorIntStatusDataCRC
+                        | kSDHCRegErrorIntStatusDataEndBit | kSDHCRegErrorIntStatusCurrentLimit | kSDHCRegErrorIntStatusAutoCmd
+                        | kSDHCRegErrorIntStatusADMA | kSDHCRegErrorIntStatusTuningError);
   _cardSlot->setControllerInsertionEvents(true);
   
   return true;
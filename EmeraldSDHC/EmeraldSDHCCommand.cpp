@@ -30,6 +30,7 @@ void EmeraldSDHCCommand::zeroCommand() {
   memoryDescriptor = nullptr;
   memoryDescriptorOffset = 0;
   currentDataOffset = 0;
+  isRetuneCommand = false;
   dmaCommand->clearMemoryDescriptor();
   bzero(&completion, sizeof (completion));
 }
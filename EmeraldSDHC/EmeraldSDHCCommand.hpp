@@ -65,6 +65,8 @@ public:
   IOStorageCompletion completion;
   
   bool newCardSelectionState;
+  // Commands issued by re-tuning run while other commands are held.
+  bool isRetuneCommand;
   
   UInt64 totalLength = 0;
 
@@ -78,6 +80,7 @@ public:
   //
   void zeroCommand();
   void setTimeoutMS(UInt32 timeoutMS);
+  inline UInt32 getTimeoutMS() { return _timeoutMS; }
   void setBuffer(IOMemoryDescriptor *memoryDescriptor);
   void setPosition(IOByteCount position);
   void setByteCount(IOByteCount byteCount);
@@ -0,0 +1,253 @@
+//
+//  EmeraldSDHCRegisterAccess.hpp
+//  EmeraldSDHC register access policies
+//
+//  Copyright © 2021-2023 Goldfish64. All rights reserved.
+//
+
+#ifndef EmeraldSDHCRegisterAccess_hpp
+#define EmeraldSDHCRegisterAccess_hpp
+
+#include <IOKit/IOLib.h>
+#include <libkern/OSByteOrder.h>
+
+#include "SDRegMap.hpp"
+#include "SDRegs.hpp"
+
+//
+// Default register access policy, directly accesses MMIO.
+//
+class EmeraldSDHCRegisterAccessMMIO {
+public:
+  static inline void write8(volatile void *base, UInt8 slot, UInt32 offset, UInt8 value) {
+    *(volatile UInt8 *)((uintptr_t)base + offset) = value;
+  }
+  static inline UInt8 read8(volatile void *base, UInt8 slot, UInt32 offset) {
+    return *(volatile UInt8 *)((uintptr_t)base + offset);
+  }
+  static inline void write16(volatile void *base, UInt8 slot, UInt32 offset, UInt16 value) {
+    OSWriteLittleInt16(base, offset, value);
+  }
+  static inline UInt16 read16(volatile void *base, UInt8 slot, UInt32 offset) {
+    return OSReadLittleInt16(base, offset);
+  }
+  static inline void write32(volatile void *base, UInt8 slot, UInt32 offset, UInt32 value) {
+    OSWriteLittleInt32(base, offset, value);
+  }
+  static inline UInt32 read32(volatile void *base, UInt8 slot, UInt32 offset) {
+    return OSReadLittleInt32(base, offset);
+  }
+  static inline void write64(volatile void *base, UInt8 slot, UInt32 offset, UInt64 value) {
+    OSWriteLittleInt64(base, offset, value);
+  }
+  static inline UInt64 read64(volatile void *base, UInt8 slot, UInt32 offset) {
+    return OSReadLittleInt64(base, offset);
+  }
+
+  //
+  // Called for each register read served from a slot's register shadows instead.
+  //
+  static inline void recordShadowRead() { }
+};
+
+#if EMERALDSDHC_REGISTER_TRACE && EMERALDSDHC_REGISTER_REPLAY
+#error "Register tracing and replay cannot be enabled together"
+#endif
+
+#if EMERALDSDHC_REGISTER_TRACE || EMERALDSDHC_REGISTER_REPLAY
+#include <libkern/OSAtomic.h>
+#include <libkern/c++/OSData.h>
+
+//
+// Register trace entry, shared by the tracing and replaying policies.
+// Flags contain the access width in bytes, with the write flag set for writes.
+// Sequence is the one-based number of the access when traced, and zero while the entry is being written. It is not used by replay.
+//
+#define kEmeraldSDHCRegisterTraceWrite      BIT7
+#define kEmeraldSDHCRegisterTraceWidthMask  0x0F
+
+typedef struct {
+  UInt64  timestamp;
+  UInt64  value;
+  UInt16  offset;
+  UInt8   slot;
+  UInt8   flags;
+  UInt32  sequence;
+} EmeraldSDHCRegisterTraceEntry;
+#endif
+
+#if EMERALDSDHC_REGISTER_TRACE
+#define kEmeraldSDHCRegisterTraceSize   4096 // Must be a power of two.
+
+#define kEmeraldSDHCRegisterTraceRequestKey         "RequestRegisterTrace"
+#define kEmeraldSDHCRegisterTraceKey                "RegisterTrace"
+#define kEmeraldSDHCRegisterTraceReadCountKey       "RegisterTraceReadCount"
+#define kEmeraldSDHCRegisterTraceWriteCountKey      "RegisterTraceWriteCount"
+#define kEmeraldSDHCRegisterTraceCommandCountKey    "RegisterTraceCommandCount"
+#define kEmeraldSDHCRegisterTraceShadowReadCountKey "RegisterTraceShadowReadCount"
+
+//
+// Tracing register access policy.
+// Accesses MMIO and records every access into a ring buffer shared by all slots.
+//
+// Entries are claimed with an atomic increment and no locks are taken,
+//   making this safe to use from primary interrupt context.
+// An entry's sequence is only set once the rest of it is written, entries being written while copied are left out of the copy.
+//
+// Reads, writes, and commands sent are also counted over the whole run, along with reads served from register shadows.
+// Reads per command with and without the shadowed reads give the MMIO reads saved by the shadows.
+//
+class EmeraldSDHCRegisterAccessTrace {
+  static EmeraldSDHCRegisterTraceEntry  _entries[kEmeraldSDHCRegisterTraceSize];
+  static volatile SInt32                _nextEntry;
+  static volatile SInt64                _readCount;
+  static volatile SInt64                _writeCount;
+  static volatile SInt64                _commandCount;
+  static volatile SInt64                _shadowReadCount;
+
+  static inline void record(UInt8 slot, UInt32 offset, UInt8 flags, UInt64 value) {
+    UInt32                        sequence = (UInt32) OSIncrementAtomic(&_nextEntry);
+    EmeraldSDHCRegisterTraceEntry *entry   = &_entries[sequence & (kEmeraldSDHCRegisterTraceSize - 1)];
+
+    if (flags & kEmeraldSDHCRegisterTraceWrite) {
+      OSIncrementAtomic64(&_writeCount);
+      if (offset == SDHCRegCommand::offset) {
+        OSIncrementAtomic64(&_commandCount);
+      }
+    } else {
+      OSIncrementAtomic64(&_readCount);
+    }
+
+    *(volatile UInt32 *) &entry->sequence = 0;
+    OSMemoryBarrier();
+    entry->timestamp = mach_absolute_time();
+    entry->value     = value;
+    entry->offset    = offset;
+    entry->slot      = slot;
+    entry->flags     = flags;
+    OSMemoryBarrier();
+    *(volatile UInt32 *) &entry->sequence = sequence + 1;
+  }
+
+public:
+  static inline void write8(volatile void *base, UInt8 slot, UInt32 offset, UInt8 value) {
+    record(slot, offset, sizeof (value) | kEmeraldSDHCRegisterTraceWrite, value);
+    EmeraldSDHCRegisterAccessMMIO::write8(base, slot, offset, value);
+  }
+  static inline UInt8 read8(volatile void *base, UInt8 slot, UInt32 offset) {
+    UInt8 value = EmeraldSDHCRegisterAccessMMIO::read8(base, slot, offset);
+    record(slot, offset, sizeof (value), value);
+    return value;
+  }
+  static inline void write16(volatile void *base, UInt8 slot, UInt32 offset, UInt16 value) {
+    record(slot, offset, sizeof (value) | kEmeraldSDHCRegisterTraceWrite, value);
+    EmeraldSDHCRegisterAccessMMIO::write16(base, slot, offset, value);
+  }
+  static inline UInt16 read16(volatile void *base, UInt8 slot, UInt32 offset) {
+    UInt16 value = EmeraldSDHCRegisterAccessMMIO::read16(base, slot, offset);
+    record(slot, offset, sizeof (value), value);
+    return value;
+  }
+  static inline void write32(volatile void *base, UInt8 slot, UInt32 offset, UInt32 value) {
+    record(slot, offset, sizeof (value) | kEmeraldSDHCRegisterTraceWrite, value);
+    EmeraldSDHCRegisterAccessMMIO::write32(base, slot, offset, value);
+  }
+  static inline UInt32 read32(volatile void *base, UInt8 slot, UInt32 offset) {
+    UInt32 value = EmeraldSDHCRegisterAccessMMIO::read32(base, slot, offset);
+    record(slot, offset, sizeof (value), value);
+    return value;
+  }
+  static inline void write64(volatile void *base, UInt8 slot, UInt32 offset, UInt64 value) {
+    record(slot, offset, sizeof (value) | kEmeraldSDHCRegisterTraceWrite, value);
+    EmeraldSDHCRegisterAccessMMIO::write64(base, slot, offset, value);
+  }
+  static inline UInt64 read64(volatile void *base, UInt8 slot, UInt32 offset) {
+    UInt64 value = EmeraldSDHCRegisterAccessMMIO::read64(base, slot, offset);
+    record(slot, offset, sizeof (value), value);
+    return value;
+  }
+
+  static inline void recordShadowRead() {
+    OSIncrementAtomic64(&_shadowReadCount);
+  }
+
+  static OSData *copyTrace();
+  static void getCounts(UInt64 *readCount, UInt64 *writeCount, UInt64 *commandCount, UInt64 *shadowReadCount);
+};
+
+typedef EmeraldSDHCRegisterAccessTrace EmeraldSDHCRegisterAccessPolicy;
+#elif EMERALDSDHC_REGISTER_REPLAY
+#define kEmeraldSDHCRegisterReplayKey               "RegisterReplay"
+#define kEmeraldSDHCRegisterReplayRequestKey        "RequestRegisterReplayStatus"
+#define kEmeraldSDHCRegisterReplayPositionKey       "RegisterReplayPosition"
+#define kEmeraldSDHCRegisterReplayMismatchCountKey  "RegisterReplayMismatchCount"
+#define kEmeraldSDHCRegisterReplayRunTestsKey       "RunRegisterReplayTests"
+#define kEmeraldSDHCRegisterReplayTestsKey          "RegisterReplayTestsPassed"
+#define kEmeraldSDHCRegisterReplayDispatchRateKey   "RegisterReplaySlotInterruptsPerSecond"
+
+//
+// Replaying register access policy.
+// Serves register accesses from a recorded trace instead of MMIO, so the driver can be run against a captured session.
+//
+// Accesses are matched in order against the trace by slot, offset, width and direction.
+// Reads return the recorded value, writes are checked against the recorded value.
+// Accesses not matching the next entry are counted as mismatches and served from a per-slot register file,
+//   holding the last value read or written at each offset.
+//
+// Accesses are serialized by a lock taken with interrupts disabled, making this safe to use from primary interrupt context.
+// Only a single controller is supported in replay builds.
+//
+class EmeraldSDHCRegisterAccessReplay {
+  static IOSimpleLock                         *_lock;
+  static OSData                               *_traceData;
+  static const EmeraldSDHCRegisterTraceEntry  *_entries;
+  static UInt32                               _entryCount;
+  static UInt32                               _nextEntry;
+  static UInt32                               _mismatchCount;
+  static UInt8                                _registers[kSDHCMaximumSlotCount][kSDHCSlotRegisterWindowSize];
+
+  static UInt64 access(UInt8 slot, UInt32 offset, UInt8 flags, UInt64 value);
+
+public:
+  static inline void write8(volatile void *base, UInt8 slot, UInt32 offset, UInt8 value) {
+    access(slot, offset, sizeof (value) | kEmeraldSDHCRegisterTraceWrite, value);
+  }
+  static inline UInt8 read8(volatile void *base, UInt8 slot, UInt32 offset) {
+    return (UInt8) access(slot, offset, sizeof (UInt8), 0);
+  }
+  static inline void write16(volatile void *base, UInt8 slot, UInt32 offset, UInt16 value) {
+    access(slot, offset, sizeof (value) | kEmeraldSDHCRegisterTraceWrite, value);
+  }
+  static inline UInt16 read16(volatile void *base, UInt8 slot, UInt32 offset) {
+    return (UInt16) access(slot, offset, sizeof (UInt16), 0);
+  }
+  static inline void write32(volatile void *base, UInt8 slot, UInt32 offset, UInt32 value) {
+    access(slot, offset, sizeof (value) | kEmeraldSDHCRegisterTraceWrite, value);
+  }
+  static inline UInt32 read32(volatile void *base, UInt8 slot, UInt32 offset) {
+    return (UInt32) access(slot, offset, sizeof (UInt32), 0);
+  }
+  static inline void write64(volatile void *base, UInt8 slot, UInt32 offset, UInt64 value) {
+    access(slot, offset, sizeof (value) | kEmeraldSDHCRegisterTraceWrite, value);
+  }
+  static inline UInt64 read64(volatile void *base, UInt8 slot, UInt32 offset) {
+    return access(slot, offset, sizeof (UInt64), 0);
+  }
+
+  //
+  // Replay control.
+  // Loading a trace clears the register file and restarts the replay, a nullptr trace serves all accesses from the register file.
+  //
+  static bool loadTrace(OSData *traceData);
+  static bool loadEntries(const EmeraldSDHCRegisterTraceEntry *entries, UInt32 entryCount);
+  static void unloadTrace();
+  static void getStatus(UInt32 *position, UInt32 *entryCount, UInt32 *mismatchCount);
+  static inline void recordShadowRead() { }
+};
+
+typedef EmeraldSDHCRegisterAccessReplay EmeraldSDHCRegisterAccessPolicy;
+#else
+typedef EmeraldSDHCRegisterAccessMMIO EmeraldSDHCRegisterAccessPolicy;
+#endif
+
+#endif
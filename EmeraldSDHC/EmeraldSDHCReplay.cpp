@@ -0,0 +1,492 @@
+//
+//  EmeraldSDHCReplay.cpp
+//  EmeraldSDHC register replay and replay tests
+//
+//  Copyright © 2021-2023 Goldfish64. All rights reserved.
+//
+
+#include "EmeraldSDHC.hpp"
+#include "EmeraldSDHCSlot.hpp"
+
+#if EMERALDSDHC_REGISTER_REPLAY
+IOSimpleLock                        *EmeraldSDHCRegisterAccessReplay::_lock          = nullptr;
+OSData                              *EmeraldSDHCRegisterAccessReplay::_traceData     = nullptr;
+const EmeraldSDHCRegisterTraceEntry *EmeraldSDHCRegisterAccessReplay::_entries       = nullptr;
+UInt32                              EmeraldSDHCRegisterAccessReplay::_entryCount     = 0;
+UInt32                              EmeraldSDHCRegisterAccessReplay::_nextEntry      = 0;
+UInt32                              EmeraldSDHCRegisterAccessReplay::_mismatchCount  = 0;
+UInt8                               EmeraldSDHCRegisterAccessReplay::_registers[kSDHCMaximumSlotCount][kSDHCSlotRegisterWindowSize] = { };
+
+UInt64 EmeraldSDHCRegisterAccessReplay::access(UInt8 slot, UInt32 offset, UInt8 flags, UInt64 value) {
+  IOInterruptState                    intState;
+  const EmeraldSDHCRegisterTraceEntry *entry = nullptr;
+  UInt8                               width  = flags & kEmeraldSDHCRegisterTraceWidthMask;
+  UInt8                               *reg;
+
+  //
+  // Accesses outside of the register file read as zero and are otherwise ignored.
+  //
+  if (slot == 0 || slot > kSDHCMaximumSlotCount || (offset + width) > kSDHCSlotRegisterWindowSize) {
+    return 0;
+  }
+  reg = &_registers[slot - 1][offset];
+
+  intState = IOSimpleLockLockDisableInterrupt(_lock);
+
+  //
+  // Consume the next entry if it is the same access.
+  // Accesses past the end of the trace are mismatches as well.
+  //
+  if (_nextEntry < _entryCount) {
+    entry = &_entries[_nextEntry];
+    if (entry->slot == slot && entry->offset == offset && entry->flags == flags) {
+      _nextEntry++;
+    } else {
+      entry = nullptr;
+    }
+  }
+  if (entry == nullptr || ((flags & kEmeraldSDHCRegisterTraceWrite) && entry->value != value)) {
+    _mismatchCount++;
+  }
+
+  //
+  // Writes always update the register file, reads update it with the recorded value if matched.
+  // Register file is stored in little endian like the controller.
+  //
+  if (flags & kEmeraldSDHCRegisterTraceWrite) {
+    value = OSSwapHostToLittleInt64(value);
+    bcopy(&value, reg, width);
+  } else {
+    if (entry != nullptr) {
+      value = OSSwapHostToLittleInt64(entry->value);
+      bcopy(&value, reg, width);
+    }
+    value = 0;
+    bcopy(reg, &value, width);
+    value = OSSwapLittleToHostInt64(value);
+  }
+
+  IOSimpleLockUnlockEnableInterrupt(_lock, intState);
+  return value;
+}
+
+bool EmeraldSDHCRegisterAccessReplay::loadTrace(OSData *traceData) {
+  OSData *oldTraceData;
+  UInt32 entryCount = 0;
+
+  //
+  // Trace must be a whole number of entries, as copied out by the tracing policy.
+  //
+  if (traceData != nullptr) {
+    if ((traceData->getLength() % sizeof (EmeraldSDHCRegisterTraceEntry)) != 0) {
+      return false;
+    }
+    entryCount = traceData->getLength() / sizeof (EmeraldSDHCRegisterTraceEntry);
+    traceData->retain();
+  }
+
+  if (!loadEntries(traceData != nullptr ? (const EmeraldSDHCRegisterTraceEntry *) traceData->getBytesNoCopy() : nullptr, entryCount)) {
+    OSSafeReleaseNULL(traceData);
+    return false;
+  }
+
+  oldTraceData = _traceData;
+  _traceData   = traceData;
+  OSSafeReleaseNULL(oldTraceData);
+  return true;
+}
+
+bool EmeraldSDHCRegisterAccessReplay::loadEntries(const EmeraldSDHCRegisterTraceEntry *entries, UInt32 entryCount) {
+  IOInterruptState intState;
+
+  if (_lock == nullptr) {
+    _lock = IOSimpleLockAlloc();
+    if (_lock == nullptr) {
+      return false;
+    }
+  }
+
+  intState = IOSimpleLockLockDisableInterrupt(_lock);
+  _entries       = entries;
+  _entryCount    = entries != nullptr ? entryCount : 0;
+  _nextEntry     = 0;
+  _mismatchCount = 0;
+  bzero(_registers, sizeof (_registers));
+  IOSimpleLockUnlockEnableInterrupt(_lock, intState);
+  return true;
+}
+
+void EmeraldSDHCRegisterAccessReplay::unloadTrace() {
+  //
+  // No register access may happen after the trace is unloaded.
+  //
+  if (_lock != nullptr) {
+    IOSimpleLockFree(_lock);
+    _lock = nullptr;
+  }
+  _entries    = nullptr;
+  _entryCount = 0;
+  OSSafeReleaseNULL(_traceData);
+}
+
+void EmeraldSDHCRegisterAccessReplay::getStatus(UInt32 *position, UInt32 *entryCount, UInt32 *mismatchCount) {
+  IOInterruptState intState;
+
+  intState = IOSimpleLockLockDisableInterrupt(_lock);
+  *position      = _nextEntry;
+  *entryCount    = _entryCount;
+  *mismatchCount = _mismatchCount;
+  IOSimpleLockUnlockEnableInterrupt(_lock, intState);
+}
+
+IOReturn EmeraldSDHC::setProperties(OSObject *properties) {
+  OSDictionary *propertiesDict = OSDynamicCast(OSDictionary, properties);
+  bool         isTestRequested;
+  bool         isStatusRequested;
+  bool         isTraceLoaded;
+  UInt32       position;
+  UInt32       entryCount;
+  UInt32       mismatchCount;
+
+  //
+  // Run replay tests and publish replay progress on request, other properties are left to the superclass.
+  //
+  if (propertiesDict == nullptr) {
+    return super::setProperties(properties);
+  }
+  isTestRequested   = propertiesDict->getObject(kEmeraldSDHCRegisterReplayRunTestsKey) != nullptr;
+  isStatusRequested = propertiesDict->getObject(kEmeraldSDHCRegisterReplayRequestKey) != nullptr;
+  if (!isTestRequested && !isStatusRequested) {
+    return super::setProperties(properties);
+  }
+
+  if (isTestRequested) {
+    //
+    // Tests load their own scripts, and are meant to be run with no card activity.
+    // Controller interrupts are held off while tests run, and the trace in the personality is replayed from the start afterwards.
+    //
+    if (_isIntEnabled) {
+      _intEventSource->disable();
+    }
+    setProperty(kEmeraldSDHCRegisterReplayTestsKey, runReplayTests());
+    isTraceLoaded = EmeraldSDHCRegisterAccessReplay::loadTrace(OSDynamicCast(OSData, getProperty(kEmeraldSDHCRegisterReplayKey)));
+    if (_isIntEnabled) {
+      _intEventSource->enable();
+    }
+    if (!isTraceLoaded) {
+      EMSYSLOG("Failed to reload register replay trace");
+      return kIOReturnError;
+    }
+  }
+  if (!isStatusRequested) {
+    return kIOReturnSuccess;
+  }
+
+  EmeraldSDHCRegisterAccessReplay::getStatus(&position, &entryCount, &mismatchCount);
+  setProperty(kEmeraldSDHCRegisterReplayPositionKey, position, 32);
+  setProperty(kEmeraldSDHCRegisterReplayMismatchCountKey, mismatchCount, 32);
+  EMDBGLOG("Replayed %u of %u register accesses with %u mismatches", position, entryCount, mismatchCount);
+  return kIOReturnSuccess;
+}
+
+//
+// Replay test script entries.
+//
+#define EMReplayRead(slot, Reg, value)  { 0, (value), Reg::offset, (slot), sizeof (Reg::ValueType), 0 }
+#define EMReplayWrite(slot, Reg, value) { 0, (value), Reg::offset, (slot), sizeof (Reg::ValueType) | kEmeraldSDHCRegisterTraceWrite, 0 }
+
+#define kEmeraldSDHCReplayTestSlotCount   3
+#define kEmeraldSDHCReplayRateTestPasses  1024
+
+bool EmeraldSDHC::runReplayTests() {
+  EmeraldSDHC *testController;
+  UInt64      dispatchRate = 0;
+  bool        result;
+
+  //
+  // Tests drive driver code against scripted register accesses.
+  // A test passes if its script is consumed in order without mismatches, and the resulting driver state is as expected.
+  //
+  testController = OSTypeAlloc(EmeraldSDHC);
+  if (testController == nullptr) {
+    EMSYSLOG("Failed to allocate replay test controller");
+    return false;
+  }
+  if (!testController->init()) {
+    EMSYSLOG("Failed to initialize replay test controller");
+    testController->release();
+    return false;
+  }
+
+  result = testController->createReplayTestSlots(kEmeraldSDHCReplayTestSlotCount)
+    && testController->testReplaySlotInterrupts()
+    && testController->testReplayShadowedRegisters()
+    && testController->testReplayWaitForBits()
+    && testController->testReplaySlotInterruptRate(&dispatchRate);
+
+  testController->freeReplayTestSlots();
+  testController->release();
+
+  if (result) {
+    setProperty(kEmeraldSDHCRegisterReplayDispatchRateKey, dispatchRate, 64);
+    EMSYSLOG("Register replay tests passed, %llu slot interrupts dispatched per second", dispatchRate);
+  } else {
+    EMSYSLOG("Register replay tests failed");
+  }
+  return result;
+}
+
+bool EmeraldSDHC::createReplayTestSlots(UInt32 slotCount) {
+  EmeraldSDHCSlot *cardSlot;
+
+  //
+  // Slots are set up as if attached, but are never registered.
+  // Interrupt sources are left disabled so pending interrupt status is kept for the tests to check.
+  //
+  for (UInt32 slot = 0; slot < slotCount; slot++) {
+    cardSlot = OSTypeAlloc(EmeraldSDHCSlot);
+    if (cardSlot == nullptr) {
+      EMSYSLOG("Failed to allocate replay test slot %u", slot + 1);
+      return false;
+    }
+    if (!cardSlot->init()) {
+      EMSYSLOG("Failed to initialize replay test slot %u", slot + 1);
+      cardSlot->release();
+      return false;
+    }
+    _cardSlotNubs[slot] = cardSlot;
+    _cardSlotCount      = slot + 1;
+
+    retain();
+    cardSlot->_hostController = this;
+    cardSlot->_cardSlotId     = slot + 1;
+    if (!cardSlot->initInterruptSource()) {
+      EMSYSLOG("Failed to create interrupt source for replay test slot %u", slot + 1);
+      return false;
+    }
+  }
+  return true;
+}
+
+void EmeraldSDHC::freeReplayTestSlots() {
+  for (UInt32 slot = 0; slot < _cardSlotCount; slot++) {
+    if (_cardSlotNubs[slot] != nullptr) {
+      _cardSlotNubs[slot]->freeInterruptSource();
+      OSSafeReleaseNULL(_cardSlotNubs[slot]->_hostController);
+      OSSafeReleaseNULL(_cardSlotNubs[slot]);
+    }
+  }
+  _cardSlotCount = 0;
+}
+
+bool EmeraldSDHC::checkReplayTest(const char *name, UInt32 entryCount) {
+  UInt32 position;
+  UInt32 loadedCount;
+  UInt32 mismatchCount;
+
+  EmeraldSDHCRegisterAccessReplay::getStatus(&position, &loadedCount, &mismatchCount);
+  if (position != entryCount || mismatchCount != 0) {
+    EMSYSLOG("Replay test %s stopped at entry %u of %u with %u mismatches", name, position, entryCount, mismatchCount);
+    return false;
+  }
+  return true;
+}
+
+bool EmeraldSDHC::testReplaySlotInterrupts() {
+  UInt32 intStatus[kEmeraldSDHCReplayTestSlotCount];
+
+  //
+  // Slots 1 and 3 are pending in the first interrupt, slot 3 with an error.
+  // Slot 2 is pending in the second interrupt, but only with status not signaled.
+  //
+  static const EmeraldSDHCRegisterTraceEntry script[] = {
+    EMReplayRead(1, SDHCRegHostControllerSlotIntStatus, BIT0 | BIT2),
+    EMReplayRead(1, SDHCRegNormalIntStatus, kSDHCRegNormalIntStatusCommandComplete),
+    EMReplayRead(1, SDHCRegErrorIntStatus, 0),
+    EMReplayWrite(1, SDHCRegNormalIntStatus, kSDHCRegNormalIntStatusCommandComplete),
+    EMReplayRead(3, SDHCRegNormalIntStatus, kSDHCRegNormalIntStatusTransferComplete | kSDHCRegNormalIntStatusErrorInterrupt),
+    EMReplayRead(3, SDHCRegErrorIntStatus, kSDHCRegErrorIntStatusDataTimeout),
+    EMReplayWrite(3, SDHCRegErrorIntStatus, kSDHCRegErrorIntStatusDataTimeout),
+    EMReplayWrite(3, SDHCRegNormalIntStatus, kSDHCRegNormalIntStatusTransferComplete),
+
+    EMReplayRead(1, SDHCRegHostControllerSlotIntStatus, BIT1),
+    EMReplayRead(2, SDHCRegNormalIntStatus, kSDHCRegNormalIntStatusBlockGapEvent),
+    EMReplayRead(2, SDHCRegErrorIntStatus, 0)
+  };
+
+  if (!EmeraldSDHCRegisterAccessReplay::loadEntries(script, sizeof (script) / sizeof (script[0]))) {
+    return false;
+  }
+  for (UInt32 slot = 0; slot < _cardSlotCount; slot++) {
+    _cardSlotNubs[slot]->_regNormalIntSignalEnable = kSDHCRegNormalIntStatusCommandComplete | kSDHCRegNormalIntStatusTransferComplete;
+    _cardSlotNubs[slot]->_regErrorIntSignalEnable  = UINT16_MAX;
+    _cardSlotNubs[slot]->_intStatusPending         = 0;
+  }
+
+  filterInterrupt(nullptr);
+  filterInterrupt(nullptr);
+  if (!checkReplayTest("slot interrupts", sizeof (script) / sizeof (script[0]))) {
+    return false;
+  }
+
+  //
+  // Status must only be dispatched to the slot it belongs to.
+  //
+  for (UInt32 slot = 0; slot < kEmeraldSDHCReplayTestSlotCount; slot++) {
+    intStatus[slot] = _cardSlotNubs[slot]->_intStatusPending;
+  }
+  if (intStatus[0] != kSDHCRegNormalIntStatusCommandComplete
+      || intStatus[1] != 0
+      || intStatus[2] != (kSDHCRegNormalIntStatusTransferComplete | kSDHCRegNormalIntStatusErrorInterrupt
+                          | (kSDHCRegErrorIntStatusDataTimeout << kSDHCSlotPendingErrorIntStatusShift))) {
+    EMSYSLOG("Replay test slot interrupts has pending status 0x%X 0x%X 0x%X", intStatus[0], intStatus[1], intStatus[2]);
+    return false;
+  }
+  return true;
+}
+
+bool EmeraldSDHC::testReplayShadowedRegisters() {
+  EmeraldSDHCSlot *cardSlot = _cardSlotNubs[0];
+
+  //
+  // Fixed registers are served from the cache, and shadowed control registers are changed without reading them back.
+  // Any read is a mismatch against the write-only script.
+  //
+  static const EmeraldSDHCRegisterTraceEntry script[] = {
+    EMReplayWrite(1, SDHCRegHostControl1, kSDHCRegHostControl1DataWidth4Bit),
+    EMReplayWrite(1, SDHCRegHostControl1, kSDHCRegHostControl1DataWidth4Bit | kSDHCRegHostControl1DMA_ADMA2_32Bit),
+    EMReplayWrite(1, SDHCRegNormalIntSignalEnable, kSDHCRegNormalIntStatusCommandComplete | kSDHCRegNormalIntStatusTransferComplete
+                  | kSDHCRegNormalIntStatusCardInsertion | kSDHCRegNormalIntStatusCardRemoval)
+  };
+
+  if (!EmeraldSDHCRegisterAccessReplay::loadEntries(script, sizeof (script) / sizeof (script[0]))) {
+    return false;
+  }
+  cardSlot->_regHostControl1          = 0;
+  cardSlot->_regNormalIntSignalEnable = kSDHCRegNormalIntStatusCommandComplete | kSDHCRegNormalIntStatusTransferComplete;
+
+  cardSlot->getControllerCapabilities();
+  cardSlot->getControllerVersion();
+  cardSlot->setControllerBusWidth(kSDABusWidth4);
+  cardSlot->setControllerDMAMode(kSDATransferTypeADMA2);
+  cardSlot->setControllerInsertionEvents(true);
+  return checkReplayTest("shadowed registers", sizeof (script) / sizeof (script[0]));
+}
+
+bool EmeraldSDHC::testReplayWaitForBits() {
+  EmeraldSDHCSlot *cardSlot = _cardSlotNubs[0];
+  UInt32          waitCount;
+  UInt64          pollCount;
+  bool            result;
+
+  //
+  // Wait for command inhibit to clear after two busy polls, then for command complete with write to clear.
+  // Each wait must stop polling as soon as the condition is met.
+  //
+  static const EmeraldSDHCRegisterTraceEntry script[] = {
+    EMReplayRead(1, SDHCRegPresentState, kSDHCRegPresentStateCardCmdInhibit),
+    EMReplayRead(1, SDHCRegPresentState, kSDHCRegPresentStateCardCmdInhibit),
+    EMReplayRead(1, SDHCRegPresentState, 0),
+    EMReplayRead(1, SDHCRegNormalIntStatus, 0),
+    EMReplayRead(1, SDHCRegNormalIntStatus, kSDHCRegNormalIntStatusCommandComplete),
+    EMReplayWrite(1, SDHCRegNormalIntStatus, kSDHCRegNormalIntStatusCommandComplete)
+  };
+
+  if (!EmeraldSDHCRegisterAccessReplay::loadEntries(script, sizeof (script) / sizeof (script[0]))) {
+    return false;
+  }
+  waitCount = (UInt32) cardSlot->_waitCount;
+  pollCount = (UInt64) cardSlot->_waitPollCount;
+
+  result = cardSlot->waitForBits<SDHCRegPresentState>(kSDHCRegPresentStateCardCmdInhibit, true, false)
+    && cardSlot->waitForBits<SDHCRegNormalIntStatus>(kSDHCRegNormalIntStatusCommandComplete, false, true);
+  if (!checkReplayTest("wait for bits", sizeof (script) / sizeof (script[0]))) {
+    return false;
+  }
+
+  //
+  // Wait statistics must count both waits and every poll.
+  //
+  waitCount = (UInt32) cardSlot->_waitCount - waitCount;
+  pollCount = (UInt64) cardSlot->_waitPollCount - pollCount;
+  if (!result || waitCount != 2 || pollCount != 5) {
+    EMSYSLOG("Replay test wait for bits returned %u after %u waits and %llu polls", result, waitCount, pollCount);
+    return false;
+  }
+  return true;
+}
+
+bool EmeraldSDHC::testReplaySlotInterruptRate(UInt64 *dispatchRate) {
+  EmeraldSDHCRegisterTraceEntry *script;
+  UInt32                        passEntryCount;
+  UInt32                        entryCount;
+  UInt32                        dispatchCount = 0;
+  UInt64                        startTime;
+  UInt64                        elapsedTime;
+  bool                          result;
+
+  //
+  // Every slot is pending in every interrupt, and each interrupt must be dispatched to all slots in a single filter pass.
+  // Rate is the number of slot interrupts dispatched per second by the filter.
+  // This includes the cost of the replay policy, and is an upper bound of the driver's own dispatch cost, not a bus throughput.
+  //
+  static const EmeraldSDHCRegisterTraceEntry pass[] = {
+    EMReplayRead(1, SDHCRegHostControllerSlotIntStatus, BIT0 | BIT1 | BIT2),
+    EMReplayRead(1, SDHCRegNormalIntStatus, kSDHCRegNormalIntStatusCommandComplete),
+    EMReplayRead(1, SDHCRegErrorIntStatus, 0),
+    EMReplayWrite(1, SDHCRegNormalIntStatus, kSDHCRegNormalIntStatusCommandComplete),
+    EMReplayRead(2, SDHCRegNormalIntStatus, kSDHCRegNormalIntStatusTransferComplete),
+    EMReplayRead(2, SDHCRegErrorIntStatus, 0),
+    EMReplayWrite(2, SDHCRegNormalIntStatus, kSDHCRegNormalIntStatusTransferComplete),
+    EMReplayRead(3, SDHCRegNormalIntStatus, kSDHCRegNormalIntStatusCommandComplete),
+    EMReplayRead(3, SDHCRegErrorIntStatus, 0),
+    EMReplayWrite(3, SDHCRegNormalIntStatus, kSDHCRegNormalIntStatusCommandComplete)
+  };
+
+  passEntryCount = sizeof (pass) / sizeof (pass[0]);
+  entryCount     = passEntryCount * kEmeraldSDHCReplayRateTestPasses;
+  script         = (EmeraldSDHCRegisterTraceEntry *) IOMalloc(sizeof (*script) * entryCount);
+  if (script == nullptr) {
+    return false;
+  }
+  for (UInt32 i = 0; i < kEmeraldSDHCReplayRateTestPasses; i++) {
+    bcopy(pass, &script[i * passEntryCount], sizeof (pass));
+  }
+
+  if (!EmeraldSDHCRegisterAccessReplay::loadEntries(script, entryCount)) {
+    IOFree(script, sizeof (*script) * entryCount);
+    return false;
+  }
+  for (UInt32 slot = 0; slot < _cardSlotCount; slot++) {
+    _cardSlotNubs[slot]->_regNormalIntSignalEnable = kSDHCRegNormalIntStatusCommandComplete | kSDHCRegNormalIntStatusTransferComplete;
+    _cardSlotNubs[slot]->_regErrorIntSignalEnable  = UINT16_MAX;
+    _cardSlotNubs[slot]->_intStatusPending         = 0;
+  }
+
+  startTime = mach_absolute_time();
+  for (UInt32 i = 0; i < kEmeraldSDHCReplayRateTestPasses; i++) {
+    filterInterrupt(nullptr);
+    for (UInt32 slot = 0; slot < _cardSlotCount; slot++) {
+      if (OSBitAndAtomic(0, &_cardSlotNubs[slot]->_intStatusPending) != 0) {
+        dispatchCount++;
+      }
+    }
+  }
+  absolutetime_to_nanoseconds(mach_absolute_time() - startTime, &elapsedTime);
+
+  result = checkReplayTest("slot interrupt rate", entryCount);
+  EmeraldSDHCRegisterAccessReplay::loadEntries(nullptr, 0);
+  IOFree(script, sizeof (*script) * entryCount);
+  if (!result) {
+    return false;
+  }
+
+  if (dispatchCount != kEmeraldSDHCReplayRateTestPasses * _cardSlotCount) {
+    EMSYSLOG("Replay test slot interrupt rate dispatched %u of %u slot interrupts", dispatchCount, kEmeraldSDHCReplayRateTestPasses * _cardSlotCount);
+    return false;
+  }
+  *dispatchRate = elapsedTime != 0 ? (dispatchCount * 1000000000ULL) / elapsedTime : 0;
+  EMDBGLOG("Dispatched %u slot interrupts in %llu ns", dispatchCount, elapsedTime);
+  return true;
+}
+#endif
@@ -9,6 +9,61 @@
 
 OSDefineMetaClassAndStructors(EmeraldSDHCSlot, super);
 
+//
+// Clock divisor checks.
+// Each entry is a base clock and requested clock, with the divisor and resulting clock expected for that controller version.
+//
+typedef struct {
+  UInt32  baseClock;
+  UInt32  speedHz;
+  bool    dividedClock10Bit;
+  UInt16  divisor;
+  UInt32  actualClock;
+} EmeraldSDHCClockDivisorCheck;
+
+static constexpr EmeraldSDHCClockDivisorCheck ClockDivisorChecks[] = {
+  //
+  // Version 3.00 10-bit divided clock.
+  //
+  { 200 * MHz, 200 * MHz,                true,  0,                         200 * MHz },
+  { 100 * MHz, 200 * MHz,                true,  0,                         100 * MHz },
+  { 200 * MHz, 52 * MHz,                 true,  2,                         50 * MHz },
+  { 187 * MHz, 52 * MHz,                 true,  2,                         46750000 },
+  { 200 * MHz, 40 * MHz,                 true,  3,                         33333333 },
+  { 208 * MHz, 26 * MHz,                 true,  4,                         26 * MHz },
+  { 200 * MHz, kSDAInitSpeedClock400kHz, true,  250,                       400 * kHz },
+  { 200 * MHz, 97800,                    true,  kSDHCClockDivisor10BitMax, 97751 },
+  { 255 * MHz, 100 * kHz,                true,  kSDHCClockDivisor10BitMax, 124633 },
+  //
+  // Pre-3.00 power of two divided clock.
+  //
+  { 25 * MHz,  50 * MHz,                 false, 0,                         25 * MHz },
+  { 50 * MHz,  25 * MHz,                 false, 1,                         25 * MHz },
+  { 200 * MHz, 40 * MHz,                 false, 4,                         25 * MHz },
+  { 150 * MHz, 52 * MHz,                 false, 2,                         37500000 },
+  { 187 * MHz, 26 * MHz,                 false, 4,                         23375000 },
+  { 33 * MHz,  kSDAInitSpeedClock400kHz, false, 0x40,                      257812 },
+  { 50 * MHz,  kSDAInitSpeedClock400kHz, false, 0x40,                      390625 },
+  { 63 * MHz,  100 * kHz,                false, kSDHCClockDivisor8BitMax,  246093 }
+};
+
+static constexpr bool checkClockDivisors() {
+  for (size_t i = 0; i < (sizeof (ClockDivisorChecks) / sizeof (ClockDivisorChecks[0])); i++) {
+    const EmeraldSDHCClockDivisorCheck &check = ClockDivisorChecks[i];
+    UInt16 divisor = EmeraldSDHCSlot::calculateClockDivisor(check.baseClock, check.speedHz, check.dividedClock10Bit);
+    if (divisor != check.divisor || EmeraldSDHCSlot::calculateDividedClock(check.baseClock, divisor) != check.actualClock) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static_assert(checkClockDivisors(), "Clock divisor must match for each base and requested clock");
+
+static_assert(EmeraldSDHCSlot::calculateProgrammableClockDivisor(200 * MHz, 200 * MHz) == 0, "Programmable clock must not be divided");
+static_assert(EmeraldSDHCSlot::calculateProgrammableClockDivisor(200 * MHz, 66 * MHz) == 3, "200 MHz to 66 MHz must use 50 MHz");
+static_assert(EmeraldSDHCSlot::calculateProgrammableClockDivisor(600 * MHz, 200 * MHz) == 2, "600 MHz to 200 MHz must be exact");
+
 bool EmeraldSDHCSlot::attach(IOService *provider) {
   bool     result = false;
   OSNumber *cardSlotNumber;
@@ -57,6 +112,22 @@ bool EmeraldSDHCSlot::attach(IOService *provider) {
     setProperty("IOUnit", ioUnitNumber);
     ioUnitNumber->release();
 
+    //
+    // Cache fixed registers and current control registers.
+    //
+    _regCapabilities = readReg<SDHCRegCapabilities>();
+    _regVersion      = (SDHostControllerVersion) readRegField<SDHCRegHostControllerVersionSpec>();
+    applyQuirks(_hostController->getQuirks());
+    readControlRegisters();
+
+    //
+    // Create work loop and interrupt source for this slot.
+    //
+    if (!initInterruptSource()) {
+      break;
+    }
+    _intEventSource->enable();
+
     registerService();
 
     result = true;
@@ -70,88 +141,291 @@ bool EmeraldSDHCSlot::attach(IOService *provider) {
 }
 
 void EmeraldSDHCSlot::detach(IOService *provider) {
+  //
+  // Host controller must stop passing interrupts to this slot before the interrupt state is freed.
+  //
+  if (_hostController != nullptr) {
+    _hostController->detachCardSlot(this);
+  }
+
+  freeInterruptSource();
+
   super::detach(provider);
 }
 
-bool EmeraldSDHCSlot::waitForBits8(UInt32 offset, UInt8 mask, bool waitClear, bool writeClear) {
-  UInt32 timeout = 0;
-  do {
-    //
-    // Wait for mask to be met.
-    //
-    UInt8 value = readReg8(offset) & mask;
-    if (waitClear && value == 0) {
-      return true;
-    } else if (!waitClear && value != 0) {
-      //
-      // Clear bit if requested.
-      //
-      if (writeClear) {
-        writeReg8(offset, mask);
-      }
-      return true;
-    }
+IOWorkLoop* EmeraldSDHCSlot::getWorkLoop() const {
+  return _workLoop;
+}
 
-    IODelay(1);
-    timeout++;
-  } while (timeout <= kSDAMaskTimeout);
+bool EmeraldSDHCSlot::initInterruptSource() {
+  IOReturn status;
+
+  //
+  // Interrupt status may be read from both primary interrupt context and the work loop, and is locked.
+  // The interrupt source is signaled by the host controller when this slot has a pending interrupt, and is left disabled.
+  //
+  _intLock = IOSimpleLockAlloc();
+  if (_intLock == nullptr) {
+    EMSYSLOG("Failed to allocate interrupt lock");
+    return false;
+  }
 
-  EMSYSLOG("Timeout while waiting for register 0x%X", offset);
-  return false;
+  _workLoop = IOWorkLoop::workLoop();
+  if (_workLoop == nullptr) {
+    EMSYSLOG("Failed to create work loop");
+    return false;
+  }
+
+  _intEventSource = IOInterruptEventSource::interruptEventSource(this,
+                                                                 OSMemberFunctionCast(IOInterruptEventAction, this, &EmeraldSDHCSlot::handleInterrupt));
+  if (_intEventSource == nullptr) {
+    EMSYSLOG("Failed to create interrupt event source");
+    return false;
+  }
+  status = _workLoop->addEventSource(_intEventSource);
+  if (status != kIOReturnSuccess) {
+    EMSYSLOG("Failed to add interrupt event source to work loop with status 0x%X", status);
+    OSSafeReleaseNULL(_intEventSource);
+    return false;
+  }
+  return true;
 }
 
-bool EmeraldSDHCSlot::waitForBits16(UInt32 offset, UInt16 mask, bool waitClear, bool writeClear) {
-  UInt32 timeout = 0;
-  do {
-    //
-    // Wait for mask to be met.
-    //
-    UInt16 value = readReg16(offset) & mask;
-    if (waitClear && value == 0) {
-      return true;
-    } else if (!waitClear && value != 0) {
-      //
-      // Clear bit if requested.
-      //
-      if (writeClear) {
-        writeReg16(offset, mask);
-      }
-      return true;
-    }
+void EmeraldSDHCSlot::freeInterruptSource() {
+  if (_intEventSource != nullptr) {
+    _intEventSource->disable();
+    _workLoop->removeEventSource(_intEventSource);
+    OSSafeReleaseNULL(_intEventSource);
+  }
+  OSSafeReleaseNULL(_workLoop);
 
-    IODelay(1);
-    timeout++;
-  } while (timeout <= kSDAMaskTimeout);
+  if (_intLock != nullptr) {
+    IOSimpleLockFree(_intLock);
+    _intLock = nullptr;
+  }
+}
+
+void EmeraldSDHCSlot::applyQuirks(const SDHCQuirks *quirks) {
+  if (quirks == nullptr) {
+    return;
+  }
 
-  EMSYSLOG("Timeout while waiting for register 0x%X", offset);
-  return false;
+  //
+  // Override reported capabilities and base clock.
+  // The rest of the driver only uses the cached capabilities.
+  //
+  _regCapabilities = (_regCapabilities & ~quirks->capabilitiesClear) | quirks->capabilitiesSet;
+  if (quirks->baseClockMHz != 0) {
+    _regCapabilities = getControllerVersion() >= kSDHostControllerVersion3_00 ?
+      SDHCRegCapabilitiesBaseClockVer3::set(_regCapabilities, quirks->baseClockMHz) :
+      SDHCRegCapabilitiesBaseClockVer1::set(_regCapabilities, quirks->baseClockMHz);
+  }
+  _maxTimingMode = quirks->maxTimingMode;
+  _quirkFlags    = quirks->flags;
+
+  EMDBGLOG("Capabilities are now 0x%llX, maximum timing mode %u, flags 0x%X", _regCapabilities, _maxTimingMode, _quirkFlags);
 }
 
-bool EmeraldSDHCSlot::waitForBits32(UInt32 offset, UInt32 mask, bool waitClear, bool writeClear) {
-  UInt32 timeout = 0;
-  do {
+void EmeraldSDHCSlot::readControlRegisters() {
+  _regHostControl1          = readReg<SDHCRegHostControl1>();
+  _regPowerControl          = readReg<SDHCRegPowerControl>();
+  _regClockControl          = readReg<SDHCRegClockControl>() & ~kSDHCRegClockControlIntClockStable;
+  _regHostControl2          = readReg<SDHCRegHostControl2>();
+  _regNormalIntSignalEnable = readReg<SDHCRegNormalIntSignalEnable>();
+  _regErrorIntSignalEnable  = readReg<SDHCRegErrorIntSignalEnable>();
+}
+
+UInt32 EmeraldSDHCSlot::readInterruptStatus() {
+  //
+  // Get pending interrupts for this slot, only considering those that are enabled to raise an interrupt.
+  // Status bits that are latched but not signaled are left for the slot to poll.
+  //
+  // Interrupt lock must be held.
+  //
+  UInt16 intStatus      = readReg<SDHCRegNormalIntStatus>() & _regNormalIntSignalEnable;
+  UInt16 errorIntStatus = readReg<SDHCRegErrorIntStatus>() & _regErrorIntSignalEnable;
+
+  //
+  // Acknowledge interrupts.
+  //
+  if (errorIntStatus != 0) {
+    writeReg<SDHCRegErrorIntStatus>(errorIntStatus);
+  }
+  if (intStatus != 0) {
+    writeReg<SDHCRegNormalIntStatus>(intStatus);
+  }
+
+  //
+  // Error interrupt summary bit cannot be enabled on its own, report it with any signaled error.
+  //
+  if (errorIntStatus != 0) {
+    intStatus |= kSDHCRegNormalIntStatusErrorInterrupt;
+  }
+
+  return intStatus | (errorIntStatus << kSDHCSlotPendingErrorIntStatusShift);
+}
+
+bool EmeraldSDHCSlot::handleHostInterrupt() {
+  UInt32 intStatus;
+
+  //
+  // Called in primary interrupt context.
+  // Save status for processing on the slot work loop.
+  //
+  IOSimpleLockLock(_intLock);
+  intStatus = readInterruptStatus();
+  if (intStatus != 0) {
+    OSBitOrAtomic(intStatus, &_intStatusPending);
+  }
+  IOSimpleLockUnlock(_intLock);
+
+  if (intStatus == 0) {
+    return false;
+  }
+  _intEventSource->interruptOccurred(nullptr, nullptr, 0);
+  return true;
+}
+
+bool EmeraldSDHCSlot::getPendingInterrupts(UInt16 *intStatus, UInt16 *errorIntStatus) {
+  IOInterruptState intState;
+  UInt32           status;
+
+  //
+  // Get any interrupts raised since the last check, including ones already collected by the interrupt filter.
+  //
+  intState = IOSimpleLockLockDisableInterrupt(_intLock);
+  status = readInterruptStatus() | OSBitAndAtomic(0, &_intStatusPending);
+  IOSimpleLockUnlockEnableInterrupt(_intLock, intState);
+
+  *intStatus      = status & UINT16_MAX;
+  *errorIntStatus = status >> kSDHCSlotPendingErrorIntStatusShift;
+  return status != 0;
+}
+
+void EmeraldSDHCSlot::clearCommandInterrupts() {
+  IOInterruptState intState;
+
+  //
+  // Drop command status left over from earlier commands, both latched by the controller and already collected by the interrupt filter.
+  // A late completion from a previous command would otherwise complete the next one.
+  //
+  intState = IOSimpleLockLockDisableInterrupt(_intLock);
+  writeReg<SDHCRegErrorIntStatus>(UINT16_MAX);
+  writeReg<SDHCRegNormalIntStatus>(UINT16_MAX & ~kSDHCSlotPersistentIntStatus);
+  OSBitAndAtomic(kSDHCSlotPersistentIntStatus, &_intStatusPending);
+  IOSimpleLockUnlockEnableInterrupt(_intLock, intState);
+}
+
+void EmeraldSDHCSlot::handleInterrupt(OSObject *owner, IOInterruptEventSource *src, int intCount) {
+  //
+  // Take all interrupt status collected since the last run.
+  // Status may have already been processed by a previous run.
+  //
+  UInt32 intStatus = OSBitAndAtomic(0, &_intStatusPending);
+  if (intStatus != 0 && _intAction != nullptr) {
+    _intAction(_intTarget, intStatus & UINT16_MAX, intStatus >> kSDHCSlotPendingErrorIntStatusShift);
+  }
+}
+
+void EmeraldSDHCSlot::registerCardSlotInterrupt(OSObject *target, EmeraldSDHCSlotInterruptAction action) {
+  //
+  // Register interrupt handler for slot.
+  //
+  _intTarget = target;
+  _intAction = action;
+}
+
+template <typename T>
+bool EmeraldSDHCSlot::waitForBitsAdaptive(UInt32 offset, T mask, bool waitClear, bool writeClear, UInt32 timeoutUs) {
+  UInt64 startTime;
+  UInt64 elapsedTime;
+  UInt64 maxTime;
+  UInt32 polls   = 0;
+  UInt32 delayUs = 2;
+  bool   result  = false;
+
+  //
+  // Most waits complete within a few microseconds, spin briefly first.
+  // Longer waits back off exponentially, then sleep so the CPU is not held for the full timeout.
+  //
+  // Waits are never done in interrupt context, but callers may hold the command gate.
+  // The gate is kept held while sleeping so no commands are started in the middle of a reset.
+  //
+  startTime = mach_absolute_time();
+  while (true) {
     //
     // Wait for mask to be met.
     //
-    UInt32 value = readReg32(offset) & mask;
+    T value = readRegOfWidth(offset, mask) & mask;
+    polls++;
     if (waitClear && value == 0) {
-      return true;
+      result = true;
+      break;
     } else if (!waitClear && value != 0) {
       //
       // Clear bit if requested.
       //
       if (writeClear) {
-        writeReg32(offset, mask);
+        writeRegOfWidth(offset, mask);
       }
-      return true;
+      result = true;
+      break;
     }
 
-    IODelay(1);
-    timeout++;
-  } while (timeout <= kSDAMaskTimeout);
+    elapsedTime = getElapsedTimeUs(startTime);
+    if (elapsedTime > timeoutUs) {
+      break;
+    }
 
-  EMSYSLOG("Timeout while waiting for register 0x%X", offset);
-  return false;
+    if (elapsedTime < kSDAWaitSpinTime) {
+      IODelay(1);
+    } else if (elapsedTime < kSDAWaitBackoffTime) {
+      IODelay(delayUs);
+      if (delayUs < kSDAWaitBackoffMaxDelay) {
+        delayUs <<= 1;
+      }
+    } else {
+      IOSleep(kSDAWaitSleepTimeMs);
+    }
+  }
+
+  //
+  // Record wait statistics.
+  //
+  elapsedTime = getElapsedTimeUs(startTime);
+  OSIncrementAtomic(&_waitCount);
+  OSAddAtomic64(polls, &_waitPollCount);
+  do {
+    maxTime = _waitMaxTime;
+  } while (elapsedTime > maxTime && !OSCompareAndSwap64(maxTime, elapsedTime, &_waitMaxTime));
+
+  if (!result) {
+    EMSYSLOG("Timeout while waiting for register 0x%X after %u polls", offset, polls);
+  } else {
+    EMDBGLOG("Wait for register 0x%X completed after %u polls in %llu us", offset, polls, elapsedTime);
+  }
+  return result;
+}
+
+void EmeraldSDHCSlot::publishWaitStatistics() {
+  //
+  // Statistics are only collected on the wait path, publishing them takes the registry lock.
+  //
+  setProperty(kSDAWaitCountKey, (UInt32) _waitCount, 32);
+  setProperty(kSDAWaitPollCountKey, (UInt64) _waitPollCount, 64);
+  setProperty(kSDAWaitMaxTimeKey, _waitMaxTime, 64);
+}
+
+bool EmeraldSDHCSlot::waitForBits8(UInt32 offset, UInt8 mask, bool waitClear, bool writeClear, UInt32 timeoutUs) {
+  return waitForBitsAdaptive(offset, mask, waitClear, writeClear, timeoutUs);
+}
+
+bool EmeraldSDHCSlot::waitForBits16(UInt32 offset, UInt16 mask, bool waitClear, bool writeClear, UInt32 timeoutUs) {
+  return waitForBitsAdaptive(offset, mask, waitClear, writeClear, timeoutUs);
+}
+
+bool EmeraldSDHCSlot::waitForBits32(UInt32 offset, UInt32 mask, bool waitClear, bool writeClear, UInt32 timeoutUs) {
+  return waitForBitsAdaptive(offset, mask, waitClear, writeClear, timeoutUs);
 }
 
 const char* EmeraldSDHCSlot::getControllerVersionString() {
@@ -175,78 +449,232 @@ const char* EmeraldSDHCSlot::getControllerVersionString() {
 
 bool EmeraldSDHCSlot::resetController(UInt8 bits) {
   EMDBGLOG("Resetting host controller with bits 0x%X", bits);
-  writeReg8(kSDHCRegSoftwareReset, bits);
+  writeReg<SDHCRegSoftwareReset>(bits);
 
-  if (!waitForBits8(kSDHCRegSoftwareReset, -1, true, false)) {
+  if (!waitForBits<SDHCRegSoftwareReset>(-1, true, false)) {
     EMSYSLOG("Host controller timed out during reset");
     return false;
   }
+
+  //
+  // Full reset returns control registers to their defaults.
+  //
+  if (bits & kSDHCRegSoftwareResetAll) {
+    readControlRegisters();
+  }
   EMDBGLOG("Host controller is now reset");
   return true;
 }
 
+UInt32 EmeraldSDHCSlot::getBaseClock() {
+  UInt64 hcCaps = getControllerCapabilities();
+  UInt32 baseClock;
+
+  baseClock = (UInt32) (getControllerVersion() >= kSDHostControllerVersion3_00 ?
+    SDHCRegCapabilitiesBaseClockVer3::get(hcCaps) : SDHCRegCapabilitiesBaseClockVer1::get(hcCaps));
+  return baseClock * MHz;
+}
+
+UInt32 EmeraldSDHCSlot::getProgrammableClock() {
+  UInt64 clockMultiplier;
+  UInt64 programmableClock;
+
+  //
+  // Programmable clock is only supported on version 3.00 and newer, and only if a multiplier is reported.
+  //
+  if (getControllerVersion() < kSDHostControllerVersion3_00) {
+    return 0;
+  }
+  clockMultiplier = SDHCRegCapabilitiesClockMultiplier::get(getControllerCapabilities());
+  if (clockMultiplier == 0) {
+    return 0;
+  }
+
+  programmableClock = (UInt64) getBaseClock() * (clockMultiplier + 1);
+  return programmableClock > UINT32_MAX ? UINT32_MAX : (UInt32) programmableClock;
+}
+
+bool EmeraldSDHCSlot::getPresetValue(UInt16 *presetValue) {
+  UInt16 hcControl2;
+  UInt16 value;
+
+  //
+  // Preset values are only supported on version 3.00 and newer.
+  // The controller selects the preset from the live signaling and UHS mode in host control 2,
+  //   or from the high speed enable in host control 1 at 3.3V. Only modes with a matching preset are used.
+  //
+  if (getControllerVersion() < kSDHostControllerVersion3_00) {
+    return false;
+  }
+
+  hcControl2 = getHostControl2();
+  if ((hcControl2 & kSDHCRegHostControl21_8VSignaling) == 0) {
+    if ((getHostControl1() & kSDHCRegHostControl1HighSpeedEnable) == 0) {
+      return false;
+    }
+    value = readReg<SDHCRegPresetValueHighSpeed>();
+  } else {
+    switch (SDHCRegHostControl2UHSMode::get(hcControl2)) {
+      case kSDHCRegHostControl2UHS_DDR50:
+        value = readReg<SDHCRegPresetValueDDR50>();
+        break;
+
+      case kSDHCRegHostControl2UHS_SDR104:
+        value = readReg<SDHCRegPresetValueSDR104>();
+        break;
+
+      default:
+        return false;
+    }
+  }
+
+  //
+  // Presets not set by firmware are zero.
+  //
+  if ((value & (kSDHCRegPresetValueFreqSelectMask | kSDHCRegPresetValueClockGenSelect)) == 0) {
+    return false;
+  }
+  *presetValue = value;
+  return true;
+}
+
+UInt32 EmeraldSDHCSlot::calculatePresetClock(UInt16 presetValue) {
+  UInt16 divisor = presetValue & kSDHCRegPresetValueFreqSelectMask;
+
+  if (presetValue & kSDHCRegPresetValueClockGenSelect) {
+    UInt32 programmableClock = getProgrammableClock();
+    return programmableClock != 0 ? calculateProgrammableClock(programmableClock, divisor) : 0;
+  }
+  return calculateDividedClock(getBaseClock(), divisor);
+}
+
 bool EmeraldSDHCSlot::setControllerClock(UInt32 speedHz) {
+  UInt32 baseClock;
+  UInt32 programmableClock;
+  UInt32 actualClock;
+  UInt32 presetClock;
+  UInt16 clockDiv;
+  UInt16 programmableClockDiv;
+  UInt16 presetValue;
+  UInt16 clockControl;
+  UInt64 startTime;
+  bool   useProgrammableClock = false;
+  bool   usePresetValue       = false;
+
+  startTime = mach_absolute_time();
+
   //
-  // Clear existing clock register.
+  // Clear existing clock register and preset value usage.
   //
-  writeReg16(kSDHCRegClockControl, 0);
+  setClockControl(0);
+  if (getHostControl2() & kSDHCRegHostControl2PresetValueEnable) {
+    setHostControl2(getHostControl2() & ~kSDHCRegHostControl2PresetValueEnable);
+  }
   if (speedHz == 0) {
     return true;
   }
 
-  writeReg16(kSDHCRegClockControl, readReg16(kSDHCRegClockControl) | kSDHCRegClockControlIntClockEnable);
-  if (!waitForBits16(kSDHCRegClockControl, kSDHCRegClockControlIntClockStable, false, false)) {
-    EMSYSLOG("Host controller timed out during clock startup");
+  //
+  // Get base clock speed.
+  //
+  baseClock = getBaseClock();
+  if (baseClock == 0) {
+    EMSYSLOG("Host controller does not report a base clock");
     return false;
   }
-  EMDBGLOG("Clock is now stable");
+  EMDBGLOG("Base clock is %u MHz", baseClock / MHz);
 
   //
-  // Get base clock speed.
+  // Calculate clock divisor, using the highest clock that does not exceed the requested clock.
   //
-  UInt64 hcCaps    = readReg64(kSDHCRegCapabilities);
-  UInt32 baseClock = getControllerVersion() >= kSDHostControllerVersion3_00 ?
-    (hcCaps & kSDHCRegCapabilitiesBaseClockMaskVer3) >> kSDHCRegCapabilitiesBaseClockShift :
-    (hcCaps & kSDHCRegCapabilitiesBaseClockMaskVer1) >> kSDHCRegCapabilitiesBaseClockShift;
-  baseClock *= MHz;
-  EMDBGLOG("Base clock is %u MHz", baseClock / MHz);
+  clockDiv    = calculateClockDivisor(baseClock, speedHz, getControllerVersion() >= kSDHostControllerVersion3_00);
+  actualClock = calculateDividedClock(baseClock, clockDiv);
 
   //
-  // Calculate clock divisor.
+  // Use the programmable clock instead if it gets closer to the requested clock.
   //
-  UInt32 clockDiv;
-  for (clockDiv = 1; (baseClock / clockDiv) > speedHz; clockDiv <<= 1);
-  EMDBGLOG("Clock will be set to %u %s using divisor %u",
-           speedHz >= MHz ? (baseClock / clockDiv) / MHz : (baseClock / clockDiv) / kHz,
-           speedHz >= MHz ? "MHz" : "kHz", clockDiv);
+  programmableClock = getProgrammableClock();
+  if (programmableClock != 0) {
+    programmableClockDiv = calculateProgrammableClockDivisor(programmableClock, speedHz);
+    if (calculateProgrammableClock(programmableClock, programmableClockDiv) > actualClock) {
+      clockDiv             = programmableClockDiv;
+      actualClock          = calculateProgrammableClock(programmableClock, programmableClockDiv);
+      useProgrammableClock = true;
+    }
+  }
+
+  //
+  // Use the firmware preset value for the current host mode if it is at least as fast and within the requested clock.
+  // Host control 1 and 2 must already be programmed for the new timing mode.
+  //
+  if (getPresetValue(&presetValue)) {
+    presetClock = calculatePresetClock(presetValue);
+    EMDBGLOG("Preset value for HC2 0x%X is 0x%X (%u kHz)", getHostControl2(), presetValue, presetClock / kHz);
+    if (presetClock >= actualClock && presetClock <= speedHz) {
+      actualClock    = presetClock;
+      usePresetValue = true;
+    }
+  }
+
+  EMDBGLOG("Clock will be set to %u %s using %s divisor %u",
+           speedHz >= MHz ? actualClock / MHz : actualClock / kHz,
+           speedHz >= MHz ? "MHz" : "kHz",
+           usePresetValue ? "preset" : (useProgrammableClock ? "programmable" : "divided"), clockDiv);
+
+  //
+  // Set clock divisor and start internal clock.
+  // Upper two bits of the 10-bit divisor are only used on version 3.00 and newer.
+  // Clock divisor and generator are ignored by the controller when preset values are enabled.
+  //
+  clockControl = kSDHCRegClockControlIntClockEnable;
+  if (usePresetValue) {
+    setHostControl2(getHostControl2() | kSDHCRegHostControl2PresetValueEnable);
+  } else {
+    clockControl = SDHCRegClockControlFreqSelectLow::set(clockControl, clockDiv & UINT8_MAX);
+    clockControl = SDHCRegClockControlFreqSelectHigh::set(clockControl, clockDiv >> 8);
+    if (useProgrammableClock) {
+      clockControl |= kSDHCRegClockControlClockGenSelect;
+    }
+  }
+  setClockControl(clockControl);
+
+  if (!waitForBits<SDHCRegClockControl>(kSDHCRegClockControlIntClockStable, false, false)) {
+    EMSYSLOG("Host controller timed out during clock startup");
+    return false;
+  }
+  EMDBGLOG("Clock is now stable");
 
   //
-  // Set clock divisor and start SD clock.
+  // Start SD clock and wait for the minimum number of clock cycles.
   //
-  UInt16 newClockDiv = ((clockDiv << kSDHCRegClockControlFreqSelectLowShift) & kSDHCRegClockControlFreqSelectLowMask)
-    | ((clockDiv >> kSDHCRegClockControlFreqSelectHighRhShift) & kSDHCRegClockControlFreqSelectHighMask);
-  writeReg16(kSDHCRegClockControl, readReg16(kSDHCRegClockControl) | newClockDiv);
-  writeReg16(kSDHCRegClockControl, readReg16(kSDHCRegClockControl) | kSDHCRegClockControlSDClockEnable);
-  EMDBGLOG("Clock control register is now 0x%X", readReg16(kSDHCRegClockControl));
-  IOSleep(50);
+  setClockControl(getClockControl() | kSDHCRegClockControlSDClockEnable);
+  IODelay(((kSDAInitClockCycles * MHz) / actualClock) + 1);
+  EMDBGLOG("Clock control register is now 0x%X, clock started in %llu us", getClockControl(), getElapsedTimeUs(startTime));
 
   return true;
 }
 
 void EmeraldSDHCSlot::setControllerPower(bool enabled) {
+  UInt64 startTime = mach_absolute_time();
+
   //
   // Clear power register.
+  // Power must remain off for a minimum time if it was previously on.
   //
-  writeReg16(kSDHCRegPowerControl, 0);
+  bool wasEnabled = getPowerControl() & kSDHCRegPowerControlVDD1On;
+  setPowerControl(0);
   if (!enabled) {
     return;
   }
+  if (wasEnabled) {
+    IOSleep(kSDAPowerOffTimeMs);
+  }
 
   //
   // Get highest supported card voltage and enable it.
   //
-  UInt64 hcCaps       = readReg64(kSDHCRegCapabilities);
-  UInt16 powerControl = readReg16(kSDHCRegPowerControl);
+  UInt64 hcCaps       = getControllerCapabilities();
+  UInt8  powerControl = getPowerControl();
   if (hcCaps & kSDHCRegCapabilitiesVoltage3_3Supported) {
     powerControl |= kSDHCRegPowerControlVDD1_3_3;
     EMDBGLOG("Card voltage: 3.3V");
@@ -257,53 +685,65 @@ void EmeraldSDHCSlot::setControllerPower(bool enabled) {
     powerControl |= kSDHCRegPowerControlVDD1_1_8;
     EMDBGLOG("Card voltage: 1.8V");
   }
-  writeReg16(kSDHCRegPowerControl, powerControl);
+  setPowerControl(powerControl);
 
   //
   // Turn power on to card.
   //
-  writeReg16(kSDHCRegPowerControl, readReg16(kSDHCRegPowerControl) | kSDHCRegPowerControlVDD1On);
-  EMDBGLOG("Card power control register is now 0x%X", readReg16(kSDHCRegPowerControl));
-  IOSleep(50);
+  setPowerControl(getPowerControl() | kSDHCRegPowerControlVDD1On);
+  IOSleep(kSDAPowerRampTimeMs);
+  EMDBGLOG("Card power control register is now 0x%X, power on in %llu us", getPowerControl(), getElapsedTimeUs(startTime));
 }
 
 void EmeraldSDHCSlot::setControllerBusWidth(SDABusWidth busWidth) {
   //
   // Set controller bus width bits.
   //
-  UInt16 hcControl = readReg16(kSDHCRegHostControl1) & ~kSDHCRegHostControl1DataWidthMask;
+  UInt8 dataWidth = 0;
   if (busWidth == kSDABusWidth4) {
-    hcControl |= kSDHCRegHostControl1DataWidth4Bit;
+    dataWidth = kSDHCRegHostControl1DataWidth4Bit;
     EMDBGLOG("Setting controller bus width to 4-bit mode");
   } else if (busWidth == kSDABusWidth8) {
-    hcControl |= kSDHCRegHostControl1DataWidth8Bit;
+    dataWidth = kSDHCRegHostControl1DataWidth8Bit;
     EMDBGLOG("Setting controller bus width to 8-bit mode");
   } else {
     EMDBGLOG("Setting controller bus width to 1-bit mode");
   }
-  writeReg16(kSDHCRegHostControl1, hcControl);
+  setHostControl1(SDHCRegHostControl1DataWidth::set(getHostControl1(), dataWidth));
+}
+
+void EmeraldSDHCSlot::setControllerEnhancedStrobe(bool enable) {
+  //
+  // Enhanced strobe has no standard control, only controllers with a known vendor register are supported.
+  //
+  if (!isEnhancedStrobeSupported()) {
+    return;
+  }
+
+  updateRegField<SDHCRegIntelHS400EnhancedStrobeEnable>(enable ? 1 : 0);
+  EMDBGLOG("Controller enhanced strobe is now %s", enable ? "enabled" : "disabled");
 }
 
 void EmeraldSDHCSlot::setControllerDMAMode(SDATransferType type) {
   //
   // Set DMA mode. TODO: Support v4 controllers and 64-bit operation on supported controllers.
   //
-  UInt16 hcControl = readReg16(kSDHCRegHostControl1) & ~kSDHCRegHostControl1DMA_Mask;
+  UInt8 dmaSelect = kSDHCRegHostControl1DMA_SDMA;
   if (type == kSDATransferTypeADMA2) {
-    hcControl |= kSDHCRegHostControl1DMA_ADMA2_32Bit;
+    dmaSelect = kSDHCRegHostControl1DMA_ADMA2_32Bit;
     EMDBGLOG("Setting controller DMA mode to 32-bit ADMA2");
   } else {
     EMDBGLOG("Setting controller DMA mode to SDMA");
   }
-  writeReg16(kSDHCRegHostControl1, hcControl);
+  setHostControl1(SDHCRegHostControl1DMASelect::set(getHostControl1(), dmaSelect));
 }
 
 void EmeraldSDHCSlot::setControllerInsertionEvents(bool enable) {
-  UInt16 intEnable = readReg16(kSDHCRegNormalIntSignalEnable);
+  UInt16 intEnable = getNormalIntSignalEnable();
   if (enable) {
     intEnable |= kSDHCRegNormalIntStatusCardInsertion | kSDHCRegNormalIntStatusCardRemoval;
   } else {
     intEnable &= ~(kSDHCRegNormalIntStatusCardInsertion | kSDHCRegNormalIntStatusCardRemoval);
   }
-  writeReg16(kSDHCRegNormalIntSignalEnable, intEnable);
+  setNormalIntSignalEnable(intEnable);
 }
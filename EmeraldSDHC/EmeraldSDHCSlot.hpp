@@ -8,84 +8,332 @@
 #ifndef EmeraldSDHCSlot_hpp
 #define EmeraldSDHCSlot_hpp
 
+#include <IOKit/IOInterruptEventSource.h>
 #include <IOKit/IOService.h>
 
 #include "EmeraldSDHC.hpp"
 #include "SDMisc.hpp"
+#include "SDRegMap.hpp"
+
+typedef void (*EmeraldSDHCSlotInterruptAction)(void *target, UInt16 intStatus, UInt16 errorIntStatus);
+
+//
+// Pending interrupt status is stored as normal status in the lower half, error status in the upper half.
+//
+#define kSDHCSlotPendingErrorIntStatusShift 16
+
+//
+// Interrupt status not tied to a command, kept pending when a new command is sent.
+//
+#define kSDHCSlotPersistentIntStatus  (kSDHCRegNormalIntStatusCardInsertion | kSDHCRegNormalIntStatusCardRemoval \
+                                       | kSDHCRegNormalIntStatusRetuningEvent)
 
 class EmeraldSDHCSlot : public IOService {
   OSDeclareDefaultStructors(EmeraldSDHCSlot);
   EMDeclareLogFunctionsHC(EmeraldSDHCSlot);
   typedef IOService super;
 
+#if EMERALDSDHC_REGISTER_REPLAY
+  //
+  // Replay tests set up slots without attaching them.
+  //
+  friend class EmeraldSDHC;
+#endif
+
 private:
   EmeraldSDHC *_hostController = nullptr;
   UInt8       _cardSlotId      = 0;
 
+  //
+  // Each slot has its own work loop so slots do not block each other.
+  //
+  IOWorkLoop             *_workLoop       = nullptr;
+  IOInterruptEventSource *_intEventSource = nullptr;
+
+  OSObject                       *_intTarget        = nullptr;
+  EmeraldSDHCSlotInterruptAction _intAction         = nullptr;
+  IOSimpleLock                   *_intLock          = nullptr;
+  volatile UInt32                _intStatusPending  = 0;
+
+  //
+  // Register shadows.
+  // Capabilities and version never change, control registers are only changed by this driver.
+  // Control registers are reloaded after a full reset.
+  //
+  UInt64                  _regCapabilities          = 0;
+  SDHostControllerVersion _regVersion               = kSDHostControllerVersion1_00;
+  UInt8                   _regHostControl1          = 0;
+  UInt8                   _regPowerControl          = 0;
+  UInt16                  _regClockControl          = 0;
+  UInt16                  _regHostControl2          = 0;
+  UInt16                  _regNormalIntSignalEnable = 0;
+  UInt16                  _regErrorIntSignalEnable  = 0;
+
+  //
+  // Fastest timing mode allowed on this slot.
+  //
+  SDATimingMode           _maxTimingMode            = kSDATimingModeHS400;
+  UInt32                  _quirkFlags               = 0;
+
+  //
+  // Widest working bus width found by the bus test, kept until the card changes.
+  //
+  SDABusWidth             _detectedBusWidth         = kSDABusWidth1;
+  bool                    _isBusWidthDetected       = false;
+
+  //
+  // Type of the last card identified in this slot, kept across card changes.
+  //
+  SDACardType             _lastCardType             = kSDACardTypeSD_200;
+  bool                    _hasLastCardType          = false;
+
+  //
+  // Register wait statistics.
+  // Waits run outside of the command gate as well, statistics are only updated atomically.
+  //
+  volatile SInt32         _waitCount                = 0;
+  volatile SInt64         _waitPollCount            = 0;
+  volatile UInt64         _waitMaxTime              = 0;
+
+  //
+  // Raw register access by width through the host controller, only used by the typed register accessors.
+  //
+  template <typename T>
+  inline T readRegOfWidth(UInt32 offset, T) { return _hostController->readRegOfWidth(_cardSlotId, offset, (T) 0); }
+  template <typename T>
+  inline void writeRegOfWidth(UInt32 offset, T value) { _hostController->writeRegOfWidth(_cardSlotId, offset, value); }
+  bool waitForBits8(UInt32 offset, UInt8 mask, bool waitClear, bool writeClear, UInt32 timeoutUs);
+  bool waitForBits16(UInt32 offset, UInt16 mask, bool waitClear, bool writeClear, UInt32 timeoutUs);
+  bool waitForBits32(UInt32 offset, UInt32 mask, bool waitClear, bool writeClear, UInt32 timeoutUs);
+  inline bool waitForBitsOfWidth(UInt32 offset, UInt8 mask, bool waitClear, bool writeClear, UInt32 timeoutUs) {
+    return waitForBits8(offset, mask, waitClear, writeClear, timeoutUs);
+  }
+  inline bool waitForBitsOfWidth(UInt32 offset, UInt16 mask, bool waitClear, bool writeClear, UInt32 timeoutUs) {
+    return waitForBits16(offset, mask, waitClear, writeClear, timeoutUs);
+  }
+  inline bool waitForBitsOfWidth(UInt32 offset, UInt32 mask, bool waitClear, bool writeClear, UInt32 timeoutUs) {
+    return waitForBits32(offset, mask, waitClear, writeClear, timeoutUs);
+  }
+
+  template <typename T>
+  bool waitForBitsAdaptive(UInt32 offset, T mask, bool waitClear, bool writeClear, UInt32 timeoutUs);
+  void applyQuirks(const SDHCQuirks *quirks);
+  UInt32 getBaseClock();
+  UInt32 getProgrammableClock();
+  bool getPresetValue(UInt16 *presetValue);
+  UInt32 calculatePresetClock(UInt16 presetValue);
+  void readControlRegisters();
+  bool initInterruptSource();
+  void freeInterruptSource();
+  UInt32 readInterruptStatus();
+  void handleInterrupt(OSObject *owner, IOInterruptEventSource *src, int intCount);
+
 public:
   //
   // IOService overrides.
   //
   bool attach(IOService *provider) APPLE_KEXT_OVERRIDE;
   void detach(IOService *provider) APPLE_KEXT_OVERRIDE;
-  
+  IOWorkLoop *getWorkLoop() const APPLE_KEXT_OVERRIDE;
+
   //
   // Host controller functions.
   //
-  bool waitForBits8(UInt32 offset, UInt8 mask, bool waitClear, bool writeClear);
-  bool waitForBits16(UInt32 offset, UInt16 mask, bool waitClear, bool writeClear);
-  bool waitForBits32(UInt32 offset, UInt32 mask, bool waitClear, bool writeClear);
   inline SDHostControllerVersion getControllerVersion() {
-    return (SDHostControllerVersion) (readReg16(kSDHCRegHostControllerVersion) & kSDHCRegHostControllerVersionMask);
+    EmeraldSDHCRegisterAccessPolicy::recordShadowRead();
+    return _regVersion;
   }
   const char* getControllerVersionString();
   inline UInt64 getControllerCapabilities() {
-    return readReg64(kSDHCRegCapabilities);
+    EmeraldSDHCRegisterAccessPolicy::recordShadowRead();
+    return _regCapabilities;
+  }
+  inline SDATimingMode getMaxTimingMode() {
+    return _maxTimingMode;
+  }
+  inline bool isEnhancedStrobeSupported() {
+    return _quirkFlags & kSDHCQuirkFlagIntelEnhancedStrobe;
+  }
+  inline bool isSlotEmbedded() {
+    return (_regCapabilities & kSDHCRegCapabilitiesSlotTypeMask) == kSDHCRegCapabilitiesSlotTypeEmbedded;
+  }
+  inline bool getLastCardType(SDACardType *cardType) {
+    if (_hasLastCardType) {
+      *cardType = _lastCardType;
+    }
+    return _hasLastCardType;
+  }
+  inline void setLastCardType(SDACardType cardType) {
+    _lastCardType    = cardType;
+    _hasLastCardType = true;
+  }
+  inline bool getDetectedBusWidth(SDABusWidth *busWidth) {
+    if (_isBusWidthDetected) {
+      *busWidth = _detectedBusWidth;
+    }
+    return _isBusWidthDetected;
+  }
+  inline void setDetectedBusWidth(SDABusWidth busWidth) {
+    _detectedBusWidth   = busWidth;
+    _isBusWidthDetected = true;
+  }
+  inline void clearDetectedBusWidth() {
+    _isBusWidthDetected = false;
   }
   inline bool isCardPresent() {
-    return readReg32(kSDHCRegPresentState) & kSDHCRegPresentStateCardInserted;
+    return readReg<SDHCRegPresentState>() & kSDHCRegPresentStateCardInserted;
   }
   inline bool isCardWriteProtected() {
-    return (readReg32(kSDHCRegPresentState) & kSDHCRegPresentStateCardWriteable) == 0;
+    return (readReg<SDHCRegPresentState>() & kSDHCRegPresentStateCardWriteable) == 0;
+  }
+  // Card signals busy by holding DAT0 low, timeout is in microseconds.
+  inline bool waitForCardIdle(UInt32 timeoutUs = kSDAMaskTimeout) {
+    return waitForBits<SDHCRegPresentState>(kSDHCRegPresentStateDat0Level, false, false, timeoutUs);
+  }
+  //
+  // Clock divisor functions.
+  // Version 3.00 and newer controllers use a 10-bit divided clock of base / 2N, older controllers only support powers of two.
+  // Divisor 0 is always the base clock.
+  //
+  static constexpr UInt16 calculateClockDivisor(UInt32 baseClock, UInt32 speedHz, bool dividedClock10Bit) {
+    UInt32 divisor = 0;
+    if (baseClock <= speedHz) {
+      return 0;
+    }
+
+    if (dividedClock10Bit) {
+      //
+      // Round up so the resulting clock never exceeds the requested clock.
+      //
+      divisor = (baseClock + (2 * speedHz) - 1) / (2 * speedHz);
+      return divisor > kSDHCClockDivisor10BitMax ? kSDHCClockDivisor10BitMax : divisor;
+    }
+
+    for (divisor = 1; divisor < kSDHCClockDivisor8BitMax && (baseClock / (2 * divisor)) > speedHz; divisor <<= 1);
+    return divisor;
+  }
+  static constexpr UInt32 calculateDividedClock(UInt32 baseClock, UInt16 divisor) {
+    return divisor == 0 ? baseClock : baseClock / (2 * divisor);
+  }
+
+  //
+  // Programmable clock functions.
+  // The programmable clock is the base clock times the capabilities clock multiplier, divided by N + 1.
+  //
+  static constexpr UInt16 calculateProgrammableClockDivisor(UInt32 programmableClock, UInt32 speedHz) {
+    UInt32 divisor = 0;
+    if (programmableClock <= speedHz) {
+      return 0;
+    }
+
+    divisor = ((programmableClock + speedHz - 1) / speedHz) - 1;
+    return divisor > kSDHCClockDivisor10BitMax ? kSDHCClockDivisor10BitMax : divisor;
+  }
+  static constexpr UInt32 calculateProgrammableClock(UInt32 programmableClock, UInt16 divisor) {
+    return programmableClock / (divisor + 1);
   }
+
   bool resetController(UInt8 bits);
   bool setControllerClock(UInt32 speedHz);
   void setControllerPower(bool enabled);
   void setControllerBusWidth(SDABusWidth busWidth);
+  void setControllerEnhancedStrobe(bool enable);
   void setControllerDMAMode(SDATransferType type);
   void setControllerInsertionEvents(bool enable);
+  void publishWaitStatistics();
 
   //
-  // Parent host controller functions.
+  // Shadowed control register functions.
+  // Getters are counted as shadowed reads in register trace builds.
   //
-  inline UInt8 getCardSlotId() { return _cardSlotId; }
-  inline void writeReg8(UInt32 offset, UInt8 value) {
-    _hostController->writeReg8(_cardSlotId, offset, value);
+  inline UInt8 getHostControl1() {
+    EmeraldSDHCRegisterAccessPolicy::recordShadowRead();
+    return _regHostControl1;
+  }
+  inline void setHostControl1(UInt8 value) {
+    _regHostControl1 = value;
+    writeReg<SDHCRegHostControl1>(value);
+  }
+  inline UInt8 getPowerControl() {
+    EmeraldSDHCRegisterAccessPolicy::recordShadowRead();
+    return _regPowerControl;
+  }
+  inline void setPowerControl(UInt8 value) {
+    _regPowerControl = value;
+    writeReg<SDHCRegPowerControl>(value);
+  }
+  inline UInt16 getClockControl() {
+    EmeraldSDHCRegisterAccessPolicy::recordShadowRead();
+    return _regClockControl;
   }
-  inline UInt8 readReg8(UInt32 offset) {
-    return _hostController->readReg8(_cardSlotId, offset);
+  inline void setClockControl(UInt16 value) {
+    _regClockControl = value;
+    writeReg<SDHCRegClockControl>(value);
   }
-  inline void writeReg16(UInt32 offset, UInt16 value) {
-    _hostController->writeReg16(_cardSlotId, offset, value);
+  inline UInt16 getHostControl2() {
+    EmeraldSDHCRegisterAccessPolicy::recordShadowRead();
+    return _regHostControl2;
   }
-  inline UInt16 readReg16(UInt32 offset) {
-    return _hostController->readReg16(_cardSlotId, offset);
+  inline void setHostControl2(UInt16 value) {
+    _regHostControl2 = value;
+    writeReg<SDHCRegHostControl2>(value);
   }
-  inline void writeReg32(UInt32 offset, UInt32 value) {
-    _hostController->writeReg32(_cardSlotId, offset, value);
+  // Tuning bits in host control 2 are changed by the controller, reload after tuning.
+  inline void reloadHostControl2() {
+    _regHostControl2 = readReg<SDHCRegHostControl2>();
+  }
+  inline UInt16 getNormalIntSignalEnable() {
+    EmeraldSDHCRegisterAccessPolicy::recordShadowRead();
+    return _regNormalIntSignalEnable;
+  }
+  inline void setNormalIntSignalEnable(UInt16 value) {
+    _regNormalIntSignalEnable = value;
+    writeReg<SDHCRegNormalIntSignalEnable>(value);
+  }
+  inline void setErrorIntSignalEnable(UInt16 value) {
+    _regErrorIntSignalEnable = value;
+    writeReg<SDHCRegErrorIntSignalEnable>(value);
+  }
+
+  //
+  // Typed register functions.
+  // Access width is taken from the register descriptor, field updates are a single read and write of the register.
+  // Shadowed control registers are updated through their shadow setters with the field descriptors instead.
+  //
+  template <typename Reg>
+  inline typename Reg::ValueType readReg() {
+    return readRegOfWidth(Reg::offset, (typename Reg::ValueType) 0);
   }
-  inline UInt32 readReg32(UInt32 offset) {
-    return _hostController->readReg32(_cardSlotId, offset);
+  template <typename Reg>
+  inline void writeReg(typename Reg::ValueType value) {
+    writeRegOfWidth(Reg::offset, value);
   }
-  inline void writeReg64(UInt32 offset, UInt64 value) {
-    _hostController->writeReg64(_cardSlotId, offset, value);
+  template <typename Field>
+  inline typename Field::ValueType readRegField() {
+    return Field::get(readReg<typename Field::Register>());
   }
-  inline UInt64 readReg64(UInt32 offset) {
-    return _hostController->readReg64(_cardSlotId, offset);
+  template <typename Field>
+  inline void updateRegField(typename Field::ValueType fieldValue) {
+    typedef typename Field::Register Reg;
+    writeReg<Reg>(Field::set(readReg<Reg>(), fieldValue));
   }
-  inline void registerCardSlotInterrupt(OSObject *target, EmeraldSDHCSlotInterruptAction action) {
-    _hostController->registerCardSlotInterrupt(_cardSlotId, target, action);
+  template <typename Reg>
+  inline bool waitForBits(typename Reg::ValueType mask, bool waitClear, bool writeClear, UInt32 timeoutUs = kSDAMaskTimeout) {
+    return waitForBitsOfWidth(Reg::offset, mask, waitClear, writeClear, timeoutUs);
   }
+
+  //
+  // Parent host controller functions.
+  //
+  inline UInt8 getCardSlotId() { return _cardSlotId; }
+
+  //
+  // Interrupt functions.
+  //
+  bool handleHostInterrupt();
+  bool getPendingInterrupts(UInt16 *intStatus, UInt16 *errorIntStatus);
+  void clearCommandInterrupts();
+  void registerCardSlotInterrupt(OSObject *target, EmeraldSDHCSlotInterruptAction action);
 };
 
 #endif
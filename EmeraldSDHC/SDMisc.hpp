@@ -19,12 +19,15 @@
 #define kSDATimeout_30sec               30000
 #define kSDATimeout_10sec               10000
 #define kSDATimeout_2sec                2000
+#define kSDATimeout_100ms               100
 
 #define kSDAInitSpeedClock400kHz        (400 * kHz)
 #define kSDANormalSpeedClock20MHz       (20 * MHz)
 #define kSDANormalSpeedClock25MHz       (25 * MHz)
 #define kSDANormalSpeedClock26MHz       (26 * MHz)
 #define kSDAHighSpeedClock25MHz         (50 * MHz)
+#define kSDAHighSpeedClock52MHz         (52 * MHz)
+#define kSDAHS200Clock200MHz            (200 * MHz)
 
 #define kSDAPowerStateOff   0
 #define kSDAPowerStateOn    1
@@ -64,6 +67,46 @@ typedef enum {
   kSDATransferTypeADMA2
 } SDATransferType;
 
+//
+// Host controller timing modes, in order of increasing speed.
+//
+typedef enum : UInt8 {
+  kSDATimingModeLegacy,
+  kSDATimingModeHighSpeed,
+  kSDATimingModeDDR52,
+  kSDATimingModeHS200,
+  kSDATimingModeHS400
+} SDATimingMode;
+
+//
+// Host controller quirks.
+// DMA modes are forced or banned by setting or clearing the ADMA2 and SDMA capability bits.
+//
+#define kSDHCQuirkMatchAnyDevice  0xFFFF
+
+typedef struct {
+  // Name used for logging.
+  const char      *name;
+  // PCI vendor and device ID, or ACPI hardware ID.
+  UInt16          vendorId;
+  UInt16          deviceId;
+  const char      *acpiHid;
+  // Capability bits to set and clear.
+  UInt64          capabilitiesSet;
+  UInt64          capabilitiesClear;
+  // Base clock in MHz to use if non-zero.
+  UInt8           baseClockMHz;
+  // Fastest timing mode known to work.
+  SDATimingMode   maxTimingMode;
+  // Additional host controller features.
+  UInt32          flags;
+} SDHCQuirks;
+
+//
+// HS400 enhanced strobe is enabled through the Intel vendor-specific register.
+//
+#define kSDHCQuirkFlagIntelEnhancedStrobe BIT0
+
 #define kSDASDMASegmentSize       0x1000
 #define kSDASDMASegmentAlignment  kSDASDMASegmentSize
 
@@ -71,7 +114,61 @@ typedef enum {
 
 #define kSDANumADMA2Descriptors   ((kSDAMaxBlocksPerTransfer * kSDABlockSize) / PAGE_SIZE)
 
+//
+// Register waits, in microseconds.
+// Waits spin briefly, then back off exponentially, then sleep until the timeout.
+//
 #define kSDAMaskTimeout           100000
+#define kSDAWaitSpinTime          10
+#define kSDAWaitBackoffTime       1000
+#define kSDAWaitBackoffMaxDelay   128
+#define kSDAWaitSleepTimeMs       1
+
+//
+// Settle times.
+// SD clock must run for at least 74 cycles after power up before the first command.
+// 1.8V signaling must be stable for 5ms before use.
+// Power must be off for at least 1ms before being reapplied, power ramp time depends on the board regulator.
+//
+#define kSDAInitClockCycles           74
+#define kSDA1_8VSignalingSettleTimeMs 5
+#define kSDAPowerOffTimeMs            1
+#define kSDAPowerRampTimeMs           10
+
+#define kSDAWaitCountKey          "RegisterWaitCount"
+#define kSDAWaitPollCountKey      "RegisterWaitPollCount"
+#define kSDAWaitMaxTimeKey        "RegisterWaitMaxTimeUs"
+
+//
+// Operating condition polling, in milliseconds.
+// Cards must complete power up initialization within 1 second of the first op-cond command.
+//
+#define kSDAOpCondTimeoutMs       1000
+#define kSDAOpCondPollInitialMs   1
+#define kSDAOpCondPollMaxMs       64
+
+#define kSDACardReadyTimeKey      "CardReadyTimeUs"
+
+//
+// Card initialization time, and the time saved when the identity of a returning card is reused.
+//
+#define kSDACardInitTimeKey       "CardInitTimeUs"
+#define kSDACardInitTimeSavedKey  "CardInitTimeSavedUs"
+
+//
+// MMC power class in use, and the power class selected for the timing mode and bus width.
+// These differ if the power class switch failed.
+//
+#define kSDACardPowerClassKey           "CardPowerClass"
+#define kSDACardPowerClassSelectedKey   "CardPowerClassSelected"
+
+//
+// Inserted cards that fail to initialize are retried, in milliseconds.
+//
+#define kSDACardInitMaxRetries    3
+#define kSDACardInitRetryDelayMs  1000
+
+#define kSDAInterruptMaxPasses    8
 
 #define kSDAInitialCommandPoolSize 10
 
@@ -125,6 +222,15 @@ typedef enum {
   kSDACardTypeMMC
 } SDACardType;
 
+//
+// Get time in microseconds since an absolute time.
+//
+inline UInt64 getElapsedTimeUs(UInt64 startTime) {
+  UInt64 elapsedTime;
+  absolutetime_to_nanoseconds(mach_absolute_time() - startTime, &elapsedTime);
+  return elapsedTime / 1000;
+}
+
 //
 // Debug printing functions.
 //
@@ -0,0 +1,122 @@
+//
+//  SDRegMap.hpp
+//  SD Host Controller typed register map
+//
+//  Copyright © 2021-2023 Goldfish64. All rights reserved.
+//
+
+#ifndef SDRegMap_hpp
+#define SDRegMap_hpp
+
+#include <IOKit/IOTypes.h>
+#include "SDRegs.hpp"
+
+//
+// Size of the register window for each slot.
+//
+#define kSDHCSlotRegisterWindowSize 0x100
+
+//
+// SD Host Controller register descriptor.
+// The value type defines the width of the register, and is used to select the access width.
+//
+template <typename T, UInt32 Offset>
+struct SDHCRegister {
+  typedef T ValueType;
+
+  static constexpr UInt32 offset = Offset;
+  static constexpr UInt32 width  = sizeof (T);
+
+  static_assert(width == 1 || width == 2 || width == 4 || width == 8, "Register width must be 8, 16, 32, or 64 bits");
+  static_assert((Offset % width) == 0, "Register must be naturally aligned");
+  static_assert((Offset + width) <= kSDHCSlotRegisterWindowSize, "Register must be within the slot register window");
+};
+
+//
+// SD Host Controller register field descriptor.
+// Fields are contained within a single register and are always updated with a single access to that register.
+//
+template <typename Reg, typename Reg::ValueType Mask, UInt32 Shift = 0>
+struct SDHCRegisterField {
+  typedef Reg                     Register;
+  typedef typename Reg::ValueType ValueType;
+
+  static constexpr ValueType mask  = Mask;
+  static constexpr UInt32    shift = Shift;
+
+  static_assert(Mask != 0, "Field mask must not be empty");
+  static_assert(Shift < (sizeof (ValueType) * 8), "Field shift must be within the register");
+
+  static constexpr ValueType get(ValueType regValue) {
+    return (ValueType) ((regValue & mask) >> shift);
+  }
+  static constexpr ValueType set(ValueType regValue, ValueType fieldValue) {
+    return (ValueType) ((regValue & ~mask) | ((fieldValue << shift) & mask));
+  }
+};
+
+//
+// SD Host Controller registers.
+//
+typedef SDHCRegister<UInt32, kSDHCRegSDMA>                          SDHCRegSDMA;
+typedef SDHCRegister<UInt16, kSDHCRegBlockSize>                     SDHCRegBlockSize;
+typedef SDHCRegister<UInt16, kSDHCRegBlockCount>                    SDHCRegBlockCount;
+typedef SDHCRegister<UInt32, kSDHCRegArgument>                      SDHCRegArgument;
+typedef SDHCRegister<UInt16, kSDHCRegTransferMode>                  SDHCRegTransferMode;
+typedef SDHCRegister<UInt16, kSDHCRegCommand>                       SDHCRegCommand;
+typedef SDHCRegister<UInt64, kSDHCRegResponse0>                     SDHCRegResponse0;
+typedef SDHCRegister<UInt64, kSDHCRegResponse1>                     SDHCRegResponse1;
+typedef SDHCRegister<UInt32, kSDHCRegBufferDataPort>                SDHCRegBufferDataPort;
+typedef SDHCRegister<UInt32, kSDHCRegPresentState>                  SDHCRegPresentState;
+typedef SDHCRegister<UInt8,  kSDHCRegHostControl1>                  SDHCRegHostControl1;
+typedef SDHCRegister<UInt8,  kSDHCRegPowerControl>                  SDHCRegPowerControl;
+typedef SDHCRegister<UInt8,  kSDHCRegBlockGapControl>               SDHCRegBlockGapControl;
+typedef SDHCRegister<UInt8,  kSDHCRegWakeupControl>                 SDHCRegWakeupControl;
+typedef SDHCRegister<UInt16, kSDHCRegClockControl>                  SDHCRegClockControl;
+typedef SDHCRegister<UInt8,  kSDHCRegTimeoutControl>                SDHCRegTimeoutControl;
+typedef SDHCRegister<UInt8,  kSDHCRegSoftwareReset>                 SDHCRegSoftwareReset;
+typedef SDHCRegister<UInt16, kSDHCRegNormalIntStatus>               SDHCRegNormalIntStatus;
+typedef SDHCRegister<UInt16, kSDHCRegErrorIntStatus>                SDHCRegErrorIntStatus;
+typedef SDHCRegister<UInt16, kSDHCRegNormalIntStatusEnable>         SDHCRegNormalIntStatusEnable;
+typedef SDHCRegister<UInt16, kSDHCRegErrorIntStatusEnable>          SDHCRegErrorIntStatusEnable;
+typedef SDHCRegister<UInt16, kSDHCRegNormalIntSignalEnable>         SDHCRegNormalIntSignalEnable;
+typedef SDHCRegister<UInt16, kSDHCRegErrorIntSignalEnable>          SDHCRegErrorIntSignalEnable;
+typedef SDHCRegister<UInt16, kSDHCRegAutoCmdErrorStatus>            SDHCRegAutoCmdErrorStatus;
+typedef SDHCRegister<UInt16, kSDHCRegHostControl2>                  SDHCRegHostControl2;
+typedef SDHCRegister<UInt64, kSDHCRegCapabilities>                  SDHCRegCapabilities;
+typedef SDHCRegister<UInt64, kSDHCRegMaxCurrentCapabilities>        SDHCRegMaxCurrentCapabilities;
+typedef SDHCRegister<UInt16, kSDHCRegForceEventAutoCmdErrorStatus>  SDHCRegForceEventAutoCmdErrorStatus;
+typedef SDHCRegister<UInt16, kSDHCRegForceEventErrorIntStatus>      SDHCRegForceEventErrorIntStatus;
+typedef SDHCRegister<UInt8,  kSDHCRegADMAErrorStatus>               SDHCRegADMAErrorStatus;
+typedef SDHCRegister<UInt32, kSDHCRegADMASysAddress>                SDHCRegADMASysAddress; // Only 32-bit ADMA2 is used.
+typedef SDHCRegister<UInt16, kSDHCRegPresetValueHighSpeed>          SDHCRegPresetValueHighSpeed;
+typedef SDHCRegister<UInt16, kSDHCRegPresetValueSDR104>             SDHCRegPresetValueSDR104;
+typedef SDHCRegister<UInt16, kSDHCRegPresetValueDDR50>              SDHCRegPresetValueDDR50;
+typedef SDHCRegister<UInt32, kSDHCRegIntelHS400EnhancedStrobe>      SDHCRegIntelHS400EnhancedStrobe;
+typedef SDHCRegister<UInt16, kSDHCRegHostControllerSlotIntStatus>   SDHCRegHostControllerSlotIntStatus;
+typedef SDHCRegister<UInt16, kSDHCRegHostControllerVersion>         SDHCRegHostControllerVersion;
+
+//
+// SD Host Controller register fields.
+//
+typedef SDHCRegisterField<SDHCRegHostControl1, kSDHCRegHostControl1DataWidthMask>   SDHCRegHostControl1DataWidth;
+typedef SDHCRegisterField<SDHCRegHostControl1, kSDHCRegHostControl1DMA_Mask>        SDHCRegHostControl1DMASelect;
+typedef SDHCRegisterField<SDHCRegHostControl2, kSDHCRegHostControl2UHS_Mask>        SDHCRegHostControl2UHSMode;
+typedef SDHCRegisterField<SDHCRegClockControl, kSDHCRegClockControlFreqSelectLowMask,
+                          kSDHCRegClockControlFreqSelectLowShift>                   SDHCRegClockControlFreqSelectLow;
+typedef SDHCRegisterField<SDHCRegClockControl, kSDHCRegClockControlFreqSelectHighMask,
+                          kSDHCRegClockControlFreqSelectHighShift>                  SDHCRegClockControlFreqSelectHigh;
+typedef SDHCRegisterField<SDHCRegCapabilities, kSDHCRegCapabilitiesBaseClockMaskVer1,
+                          kSDHCRegCapabilitiesBaseClockShift>                       SDHCRegCapabilitiesBaseClockVer1;
+typedef SDHCRegisterField<SDHCRegCapabilities, kSDHCRegCapabilitiesBaseClockMaskVer3,
+                          kSDHCRegCapabilitiesBaseClockShift>                       SDHCRegCapabilitiesBaseClockVer3;
+typedef SDHCRegisterField<SDHCRegCapabilities, kSDHCRegCapabilitiesClockMultiplierMask,
+                          kSDHCRegCapabilitiesClockMultiplierShift>                 SDHCRegCapabilitiesClockMultiplier;
+typedef SDHCRegisterField<SDHCRegCapabilities, kSDHCRegCapabilitiesRetuningTimerMask,
+                          kSDHCRegCapabilitiesRetuningTimerShift>                   SDHCRegCapabilitiesRetuningTimer;
+typedef SDHCRegisterField<SDHCRegCapabilities, kSDHCRegCapabilitiesRetuningModeMask,
+                          kSDHCRegCapabilitiesRetuningModeShift>                    SDHCRegCapabilitiesRetuningMode;
+typedef SDHCRegisterField<SDHCRegHostControllerVersion, kSDHCRegHostControllerVersionMask> SDHCRegHostControllerVersionSpec;
+typedef SDHCRegisterField<SDHCRegIntelHS400EnhancedStrobe, kSDHCRegIntelHS400EnhancedStrobeEnable> SDHCRegIntelHS400EnhancedStrobeEnable;
+
+#endif
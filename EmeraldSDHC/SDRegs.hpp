@@ -75,6 +75,7 @@
 #define kSDHCRegPresentStateCardDatInhibit    BIT1
 #define kSDHCRegPresentStateCardInserted      BIT16
 #define kSDHCRegPresentStateCardWriteable     BIT19
+#define kSDHCRegPresentStateDat0Level         BIT20
 
 #define kSDHCRegHostControl1                0x28
 #define kSDHCRegHostControl1LEDOn           BIT0
@@ -92,6 +93,7 @@
 #define kSDHCRegPowerControlVDD1_3_3    (BIT1 | BIT2 | BIT3)
 #define kSDHCRegPowerControlVDD1_3_0    (BIT2 | BIT3)
 #define kSDHCRegPowerControlVDD1_1_8    (BIT1 | BIT3)
+#define kSDHCRegPowerControlVDD1_Mask   (BIT1 | BIT2 | BIT3)
 #define kSDHCRegPowerControlVDD2On      BIT4
 #define kSDHCRegPowerControlVDD2_1_8    (BIT5 | BIT7)
 
@@ -102,10 +104,14 @@
 #define kSDHCRegClockControlIntClockStable          BIT1
 #define kSDHCRegClockControlSDClockEnable           BIT2
 #define kSDHCRegClockControlPLLEnable               BIT3
+#define kSDHCRegClockControlClockGenSelect          BIT5
 #define kSDHCRegClockControlFreqSelectLowShift      8
 #define kSDHCRegClockControlFreqSelectLowMask       0xFF00
 #define kSDHCRegClockControlFreqSelectHighRhShift   2
+#define kSDHCRegClockControlFreqSelectHighShift     6
 #define kSDHCRegClockControlFreqSelectHighMask      0xC0
+#define kSDHCClockDivisor8BitMax                    0x80
+#define kSDHCClockDivisor10BitMax                   0x3FF
 
 
 #define kSDHCRegTimeoutControl          0x2E
@@ -124,9 +130,21 @@
 #define kSDHCRegNormalIntStatusBufferReadReady    BIT5
 #define kSDHCRegNormalIntStatusCardInsertion      BIT6
 #define kSDHCRegNormalIntStatusCardRemoval        BIT7
+#define kSDHCRegNormalIntStatusRetuningEvent      BIT12
 #define kSDHCRegNormalIntStatusErrorInterrupt     BIT15
 
 #define kSDHCRegErrorIntStatus                  0x32
+#define kSDHCRegErrorIntStatusCommandTimeout    BIT0
+#define kSDHCRegErrorIntStatusCommandCRC        BIT1
+#define kSDHCRegErrorIntStatusCommandEndBit     BIT2
+#define kSDHCRegErrorIntStatusCommandIndex      BIT3
+#define kSDHCRegErrorIntStatusDataTimeout       BIT4
+#define kSDHCRegErrorIntStatusDataCRC           BIT5
+#define kSDHCRegErrorIntStatusDataEndBit        BIT6
+#define kSDHCRegErrorIntStatusCurrentLimit      BIT7
+#define kSDHCRegErrorIntStatusAutoCmd           BIT8
+#define kSDHCRegErrorIntStatusADMA              BIT9
+#define kSDHCRegErrorIntStatusTuningError       BIT10
 #define kSDHCRegNormalIntStatusEnable           0x34
 #define kSDHCRegErrorIntStatusEnable            0x36
 #define kSDHCRegNormalIntSignalEnable           0x38
@@ -172,6 +190,19 @@
 #define kSDHCRegCapabilitiesVoltage3_0Supported   BIT25
 #define kSDHCRegCapabilitiesVoltage1_8Supported   BIT26
 #define kSDHCRegCapabilitiesSlotTypeEmbedded      BIT30
+#define kSDHCRegCapabilitiesSlotTypeMask          (BIT30 | BIT31)
+
+// Upper capabilities dword.
+#define kSDHCRegCapabilitiesSDR104Supported       (1ULL << 33)
+#define kSDHCRegCapabilitiesDDR50Supported        (1ULL << 34)
+#define kSDHCRegCapabilitiesRetuningTimerShift    40
+#define kSDHCRegCapabilitiesRetuningTimerMask     (0xFULL << kSDHCRegCapabilitiesRetuningTimerShift)
+#define kSDHCRegCapabilitiesRetuningTimerMax      0xB // 0xC-0xE are reserved, 0xF is other source
+#define kSDHCRegCapabilitiesRetuningModeShift     46
+#define kSDHCRegCapabilitiesRetuningModeMask      (0x3ULL << kSDHCRegCapabilitiesRetuningModeShift)
+#define kSDHCRegCapabilitiesRetuningMode3         0x2
+#define kSDHCRegCapabilitiesClockMultiplierShift  48
+#define kSDHCRegCapabilitiesClockMultiplierMask   (0xFFULL << kSDHCRegCapabilitiesClockMultiplierShift)
 
 #define kSDHCRegMaxCurrentCapabilities  0x48
 
@@ -180,11 +211,20 @@
 #define kSDHCRegADMAErrorStatus         0x54
 #define kSDHCRegADMASysAddress          0x58
 
-#define kSDHCRegPresetValue             0x60
+#define kSDHCRegPresetValue                     0x60
+#define kSDHCRegPresetValueHighSpeed            0x64
+#define kSDHCRegPresetValueSDR104               0x6C
+#define kSDHCRegPresetValueDDR50                0x6E
+#define kSDHCRegPresetValueFreqSelectMask       0x3FF
+#define kSDHCRegPresetValueClockGenSelect       BIT10
 
 #define kSDHCRegPresetValueUHSII        0x74
 #define kSDHCRegADMA3IDAddress          0x78
 
+// Intel vendor-specific, overlaps ADMA3 ID address on version 3.00 controllers
+#define kSDHCRegIntelHS400EnhancedStrobe        0x78
+#define kSDHCRegIntelHS400EnhancedStrobeEnable  BIT0
+
 // Common across all slots on host controller
 #define kSDHCRegHostControllerSlotIntStatus   0xFC
 #define kSDHCRegHostControllerVersion         0xFE
@@ -192,6 +232,7 @@
 
 #define kSDATuneBytes4Bits      64
 #define kSDATuneBytes8Bits      128
+#define kSDATuneMaxLoops        40
 
 #define kSDAMaxBlockCount16       UINT16_MAX
 #define kSDAMaxBlockCount32       UINT32_MAX
@@ -204,6 +245,14 @@
 #define kSDAOCRCardBusy           BIT31
 #define kSDAOCRInitValue          (kSDAOCRCCSHighCapacity | 0xFF8000)
 
+//
+// MMC OCR bits
+// Initial value indicates support for 2.7-3.6V and sector access mode, required for cards larger than 2GB.
+//
+#define kMMCOCRVoltage2_7To3_6    0xFF8000
+#define kMMCOCRAccessModeSector   BIT30
+#define kMMCOCRInitValue          (kMMCOCRAccessModeSector | kMMCOCRVoltage2_7To3_6)
+
 //
 // SD Host Controller versions.
 //
@@ -358,6 +407,7 @@ typedef enum : UInt32 {
   kMMCCommandReadDatUntilStop       = 11,
   kMMCCommandStopTransmission       = 12,
   kMMCCommandSendStatus             = 13,
+  kMMCCommandBusTestRead            = 14,
   kMMCCommandGoInactiveState        = 15,
 
   //
@@ -366,6 +416,7 @@ typedef enum : UInt32 {
   kMMCCommandSetBlockLength         = 16,
   kMMCCommandReadSingleBlock        = 17,
   kMMCCommandReadMultipleBlock      = 18,
+  kMMCCommandBusTestWrite           = 19,
   kMMCCommandWriteDatUntilStop      = 20,
   kMMCCommandSendTuningBlock        = 21,
   kMMCCommandSetBlockCount          = 23,
@@ -403,6 +454,11 @@ typedef enum : UInt32 {
   kMMCCommandInvalid                = UINT32_MAX
 } MMCCommand;
 
+//
+// MMC card status, returned in R1 responses.
+//
+#define kMMCCardStatusSwitchError BIT7
+
 //
 // MMC Switch command arguments.
 //
@@ -421,6 +477,8 @@ typedef enum : UInt8 {
 #define kMMCSwitchAccessShift     24
 #define kMMCSwitchAccessMask      0x3000000
 
+#define kMMCSleepAwakeSleep       BIT15
+
 #pragma pack(push, 1)
 
 //
@@ -765,12 +823,15 @@ typedef struct {
 #define kMMCBusWidthDDR     4
 #define kMMCBusWidth4BitDDR 5
 #define kMMCBusWidth8BitDDR 6
+#define kMMCBusWidthEnhancedStrobe  BIT7
   UInt8   strobeSupport;
   UInt8   hsTiming;
 #define kMMCHSTimingDriverStrengthShift 4
 #define kMMCHSTimingDriverStrengthMask  0xF0
+#define kMMCHSTimingSpeedMask           0x0F
   UInt8   reserved12;
   UInt8   powerClass;
+#define kMMCPowerClassMask  0x0F
   UInt8   reserved13;
   UInt8   cmdSetRevision;
   UInt8   reserved14;
@@ -796,6 +857,10 @@ typedef struct {
   UInt8   driverStrength;
   UInt8   outOfInterruptTime;
   UInt8   partitionSwitchTime;
+  // Power class fields contain the 4-bit bus class in the low nibble, and the 8-bit bus class in the high nibble.
+#define kMMCPowerClass4BitMask  0x0F
+#define kMMCPowerClass8BitShift 4
+#define kMMCPowerClass8BitMask  0xF0
   UInt8   powerCL_52_195;
   UInt8   powerCL_26_195;
   UInt8   powerCL_52_360;
@@ -812,6 +877,8 @@ typedef struct {
   UInt32  sectorCount;
   UInt8   sleepNotificationTime;
   UInt8   sleepAwakeTimeout;
+// Sleep/awake timeout is 100 ns * 2^N.
+#define kMMCSleepAwakeTimeoutMax  0x17
   UInt8   productionStateAwarenessTimeout;
   UInt8   sleepCurrentVCCQ;
   UInt8   sleepCurrentVCC;
@@ -842,6 +909,9 @@ typedef struct {
   UInt8   bkOpsStatus;
   UInt8   powerOffLongTimeout;
   UInt8   genericCMD6Timeout;
+// Generic CMD6 timeout is in units of 10 ms, zero if not defined by the card.
+#define kMMCGenericCMD6TimeoutUnitMs  10
+#define kMMCGenericCMD6TimeoutDefault 500
   UInt32  cacheSize;
   UInt8   powerCL_DDR_200_360;
   UInt64  firmwareVersion;